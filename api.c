@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+// Library entry points. Everything a run needs lives in its Context, so
+// contexts can be used from different threads at the same time and the
+// in-memory entry points never touch the disk.
+
+struct Context *context_create(const struct Settings *settings, int threads) {
+    struct Context *ctx = (struct Context *)calloc(1, sizeof(struct Context));
+    if (!ctx) {
+        fprintf(stderr, "Memory allocation failed for context!\n");
+        return NULL;
+    }
+    if (settings) {
+        ctx->settings = *settings;
+    }
+    ctx->threads = threads;
+    ctx->stdio_fds[0] = STDIN_FILENO;
+    ctx->stdio_fds[1] = STDOUT_FILENO;
+    ctx->metrics.enabled = ctx->settings.metrics;
+    return ctx;
+}
+
+void context_destroy(struct Context *ctx) {
+    if (!ctx) {
+        return;
+    }
+    pool_release(ctx);
+    free(ctx);
+}
+
+void context_set_settings(struct Context *ctx,
+                          const struct Settings *settings) {
+    ctx->settings = *settings;
+    metrics_reset(ctx);
+    ctx->metrics.enabled = settings->metrics;
+}
+
+void context_set_stdio(struct Context *ctx, int input_fd, int output_fd) {
+    ctx->stdio_fds[0] = input_fd;
+    ctx->stdio_fds[1] = output_fd;
+}
+
+// Apply the context's thread count to the calling thread's OpenMP teams,
+// returns the previous count for leave_context
+static int enter_context(struct Context *ctx) {
+    int previous = omp_get_max_threads();
+    if (ctx->threads > 0) {
+        omp_set_num_threads(ctx->threads);
+    }
+    return previous;
+}
+
+static void leave_context(int previous) {
+    omp_set_num_threads(previous);
+}
+
+// Reject settings that no backend can honour together
+int check_settings(const struct Settings *settings) {
+    // Views, containers and frame ranges run their own paths, which
+    // rewrite nothing in place and honour none of the backends below
+    const struct {
+        int set;
+        const char *name;
+    } paths[] = {
+        {settings->view, "--view"},
+        {settings->compress, "--compress"},
+        {settings->first_frame > 0 || settings->last_frame > 0, "--frames"},
+    };
+    const char *path = NULL;
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i) {
+        if (!paths[i].set) {
+            continue;
+        }
+        if (settings->in_place) {
+            printf("Error: --in-place cannot be combined with %s\n",
+            paths[i].name);
+            return -1;
+        }
+        path = path ? path : paths[i].name;
+    }
+    // Each of these replaces the whole I/O path, so a run takes at most
+    // one; --in-place edits through --mmap and is bounded like --mem-limit
+    const struct {
+        int set;
+        const char *name;
+        int in_place;  // still honoured by an --in-place edit
+    } backends[] = {
+        {settings->direct, "--direct", 0},
+        {settings->uring_depth > 0, "--uring", 0},
+        {settings->mem_limit > 0, "--mem-limit", 1},
+        {settings->use_mmap, "--mmap", 1},
+        {settings->copy_range, "--copy-range", 0},
+    };
+    const char *backend = NULL;
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+        if (!backends[i].set) {
+            continue;
+        }
+        if (backend || path
+        || (settings->in_place && !backends[i].in_place)) {
+            printf("Error: %s cannot be combined with %s\n", backends[i].name,
+            backend ? backend : path ? path : "--in-place");
+            return -1;
+        }
+        backend = backends[i].name;
+    }
+    if (settings->populate && !settings->use_mmap) {
+        printf("Error: --populate needs --mmap\n");
+        return -1;
+    }
+    return 0;
+}
+
+// 1 if both paths name the same existing file
+int same_file(const char *input_file, const char *output_file) {
+    struct stat in_st, out_st;
+    return !is_stdio_path(input_file) && !is_stdio_path(output_file)
+    && stat(input_file, &in_st) == 0 && stat(output_file, &out_st) == 0
+    && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino;
+}
+
+int process_file(struct Context *ctx, const char *input_file,
+                 const char *output_file, const struct Operation *ops,
+                 int count, int memory_free) {
+    if (count < 1) {
+        printf("Error: No operation given.\n");
+        return -1;
+    }
+    if (check_settings(&ctx->settings) != 0) {
+        return -1;
+    }
+    // copy_file_range moves frames unchanged, so it has nothing to do for
+    // any other chain
+    if (ctx->settings.copy_range && (count != 1
+    || ops[0].type != OP_REVERSE)) {
+        printf("Error: --copy-range only applies to a single reverse\n");
+        return -1;
+    }
+    // Every other path truncates its output before reading the input
+    if (!ctx->settings.in_place && same_file(input_file, output_file)) {
+        printf("Error: %s is both input and output; only --in-place can"
+        " rewrite a video\n", output_file);
+        return -1;
+    }
+    int previous = enter_context(ctx);
+    int use_uring = ctx->settings.uring_depth > 0 && uring_supported();
+    if (ctx->settings.uring_depth > 0 && !use_uring) {
+        fprintf(stderr, "io_uring is not available, using stdio\n");
+    }
+    // A cached result of the same job replaces the whole run
+    char key[CACHE_KEY_SIZE];
+    int cached = ctx->settings.cache_dir && !is_stdio_path(output_file)
+    && cache_key(ctx, input_file, ops, count, key) == 0;
+    if (cached && cache_fetch(ctx, key, output_file) == 0) {
+        leave_context(previous);
+        return 0;
+    }
+    int result;
+    int stdio = is_stdio_path(input_file) || is_stdio_path(output_file);
+    if (ctx->settings.in_place && !stdio) {
+        result = in_place_process(ctx, input_file, output_file, ops, count,
+        memory_free);
+    } else if (ctx->settings.view || is_view(input_file)) {
+        result = view_process(ctx, input_file, output_file, ops, count,
+        memory_free);
+    } else if (ctx->settings.compress || is_container(input_file)) {
+        result = container_process(ctx, input_file, output_file, ops, count,
+        memory_free);
+    } else if (ctx->settings.first_frame > 0
+    || ctx->settings.last_frame > 0) {
+        result = range_process(ctx, input_file, output_file, ops, count,
+        memory_free);
+    } else if (stdio) {
+        result = pipe_process(ctx, input_file, output_file, ops, count,
+        memory_free);
+    } else if (ctx->settings.direct) {
+        result = direct_process(ctx, input_file, output_file, ops, count);
+    } else if (use_uring) {
+        result = uring_process(ctx, input_file, output_file, ops, count);
+    } else if (ctx->settings.mem_limit > 0) {
+        result = batch_process(ctx, input_file, output_file, ops, count,
+        memory_free);
+    } else if (memory_free == 1 && !ctx->settings.use_mmap
+    && !ctx->settings.copy_range) {
+        result = parallel_process(ctx, input_file, output_file, ops, count);
+    } else if (count > 1) {
+        result = pipeline_file(ctx, input_file, output_file, ops, count,
+        memory_free);
+    } else if (ops[0].type == OP_REVERSE) {
+        result = reverse_file(ctx, input_file, output_file, memory_free);
+    } else if (ops[0].type == OP_SWAP || ops[0].type == OP_PERMUTE) {
+        result = permute_file(ctx, input_file, output_file, &ops[0],
+        memory_free);
+    } else if (ops[0].type == OP_CLIP) {
+        result = clip_file(ctx, input_file, output_file, ops[0].channel,
+        ops[0].min_val, ops[0].max_val, memory_free);
+    } else {
+        result = scale_file(ctx, input_file, output_file, ops[0].channel,
+        ops[0].scale_factor, memory_free);
+    }
+    if (cached && result == 0) {
+        cache_store(ctx, key, output_file);
+    }
+    leave_context(previous);
+    return result;
+}
+
+int process_frames(struct Context *ctx, struct Video *video,
+                   const struct Operation *ops, int count, int memory_free) {
+    int reversed = check_stages(ops, count, video);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        return -1;
+    }
+    size_t channel_size = video->height * video->width;
+    size_t frame_size = video->channels * channel_size;
+    int64_t frames = video->frames;
+
+    int previous = enter_context(ctx);
+    int failed = pool_reserve(ctx, omp_get_max_threads()) != 0;
+    double start = metrics_begin(ctx);
+    #pragma omp parallel if (memory_free == 1) reduction(|:failed)
+    {
+        int t = omp_get_thread_num();
+        unsigned char *temp_channel = pool_scratch(ctx, t, SCRATCH_CHANNEL,
+        channel_size);
+        unsigned char *temp_frame = reversed ? pool_scratch(ctx, t,
+        SCRATCH_FRAME, frame_size) : NULL;
+        int ready = temp_channel && (!reversed || temp_frame);
+        failed = !ready;
+        if (reversed) {
+            #pragma omp for
+            for (int64_t i = 0; i < frames / 2; ++i) {
+                if (!ready) {
+                    continue;
+                }
+                unsigned char *front = video->data + i * frame_size;
+                unsigned char *back = video->data
+                + (frames - 1 - i) * frame_size;
+                memcpy(temp_frame, front, frame_size);
+                memcpy(front, back, frame_size);
+                memcpy(back, temp_frame, frame_size);
+            }
+        }
+        #pragma omp for
+        for (int64_t f = 0; f < frames; ++f) {
+            if (ready) {
+                apply_stages(video->data + f * frame_size, ops, count,
+                channel_size, temp_channel);
+            }
+        }
+    }
+    metrics_end(ctx, STAGE_COMPUTE, start);
+    metrics_count(ctx, 0, 0, frames);
+    leave_context(previous);
+
+    if (failed) {
+        printf("Memory allocation failed for temp buffer!\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Decode the HEADER_SIZE bytes at the start of a video
+int parse_header(const unsigned char *head, struct Video *video) {
+    int64_t frames;
+    memcpy(&frames, head, sizeof(int64_t));
+    video->frames = frames;
+    video->channels = head[8];
+    video->height = head[9];
+    video->width = head[10];
+    video->data = NULL;
+    if (video->frames < 0 || video->channels > MAX_CH
+    || video->height > MAX_H || video->width > MAX_W) {
+        fprintf(stderr, "Error: Video size exceeds maximum limit\n");
+        return -1;
+    }
+    return 0;
+}
+
+int process_buffer(struct Context *ctx, const unsigned char *input,
+                   unsigned char *output, size_t size,
+                   const struct Operation *ops, int count, int memory_free) {
+    struct Video video;
+    if (size < HEADER_SIZE) {
+        fprintf(stderr, "Error: Buffer is shorter than a video header\n");
+        return -1;
+    }
+    if (parse_header(input, &video) != 0) {
+        return -1;
+    }
+    // The header is untrusted: compare frame counts, so a huge one cannot
+    // wrap the byte count past the size check
+    size_t frame_size = (size_t)video.channels * video.height * video.width;
+    if (frame_size > 0
+    && (uint64_t)video.frames > (size - HEADER_SIZE) / frame_size) {
+        fprintf(stderr, "Error: Buffer is shorter than its header claims\n");
+        return -1;
+    }
+    size_t total_size = HEADER_SIZE + video.frames * frame_size;
+    if (size < total_size) {
+        fprintf(stderr, "Error: Buffer is shorter than its header claims\n");
+        return -1;
+    }
+
+    if (output != input) {
+        memcpy(output, input, total_size);
+    }
+    video.data = output + HEADER_SIZE;
+    return process_frames(ctx, &video, ops, count, memory_free);
+}
+
+// Frames travel through a batch of slots from the pool: read one by one,
+// edited in parallel with -S, then handed back in output order
+int process_callbacks(struct Context *ctx, const struct Video *header,
+                      const struct Operation *ops, int count, int memory_free,
+                      int (*read_frame)(unsigned char *frame, int64_t index,
+                                        void *arg),
+                      int (*write_frame)(const unsigned char *frame,
+                                         int64_t index, void *arg),
+                      void *arg) {
+    int reversed = check_stages(ops, count, header);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        return -1;
+    }
+    size_t channel_size = header->height * header->width;
+    size_t frame_size = header->channels * channel_size;
+    int64_t frames = header->frames;
+
+    int previous = enter_context(ctx);
+    int threads = omp_get_max_threads();
+    int64_t batch = memory_free == 1 ? 2 * threads : 1;
+    unsigned char *slots = pool_reserve(ctx, threads) == 0
+    ? pool_scratch(ctx, 0, SCRATCH_RING, batch * frame_size) : NULL;
+    int failed = !slots;
+
+    for (int64_t first = 0; first < frames && !failed; first += batch) {
+        int64_t n = frames - first < batch ? frames - first : batch;
+        double start = metrics_begin(ctx);
+        for (int64_t k = 0; k < n && !failed; ++k) {
+            int64_t f = first + k;
+            failed = read_frame(slots + k * frame_size,
+            reversed ? frames - 1 - f : f, arg) != 0;
+        }
+        metrics_end(ctx, STAGE_READ, start);
+        if (failed) {
+            break;
+        }
+
+        start = metrics_begin(ctx);
+        #pragma omp parallel for if (memory_free == 1) reduction(|:failed)
+        for (int64_t k = 0; k < n; ++k) {
+            unsigned char *temp_channel = pool_scratch(ctx,
+            omp_get_thread_num(), SCRATCH_CHANNEL, channel_size);
+            if (!temp_channel) {
+                failed = 1;
+                continue;
+            }
+            apply_stages(slots + k * frame_size, ops, count, channel_size,
+            temp_channel);
+        }
+        metrics_end(ctx, STAGE_COMPUTE, start);
+
+        start = metrics_begin(ctx);
+        for (int64_t k = 0; k < n && !failed; ++k) {
+            failed = write_frame(slots + k * frame_size, first + k, arg) != 0;
+        }
+        metrics_end(ctx, STAGE_WRITE, start);
+        metrics_count(ctx, n * frame_size, n * frame_size, n);
+    }
+    leave_context(previous);
+
+    if (failed) {
+        fprintf(stderr, "Error processing frames through callbacks\n");
+        return -1;
+    }
+    return 0;
+}
+
+// The path-based functions keep their old signatures, each call runs in a
+// private context with default settings
+static void run_default(const char *input_file, const char *output_file,
+                        const struct Operation *ops, int count,
+                        int memory_free) {
+    struct Context *ctx = context_create(NULL, 0);
+    if (ctx) {
+        process_file(ctx, input_file, output_file, ops, count, memory_free);
+        context_destroy(ctx);
+    }
+}
+
+void reverse_video(const char *input_file, const char *output_file,
+                   int memory_free) {
+    struct Operation op = {.type = OP_REVERSE};
+    run_default(input_file, output_file, &op, 1, memory_free);
+}
+
+void swap_channels(const char *input_file, const char *output_file,
+                   unsigned char ch1, unsigned char ch2, int memory_free) {
+    struct Operation op = {.type = OP_SWAP, .ch1 = ch1, .ch2 = ch2};
+    run_default(input_file, output_file, &op, 1, memory_free);
+}
+
+void clip_channel(const char *input_file, const char *output_file,
+                  unsigned char channel, unsigned char min_val,
+                  unsigned char max_val, int memory_free) {
+    struct Operation op = {.type = OP_CLIP, .channel = channel,
+    .min_val = min_val, .max_val = max_val};
+    run_default(input_file, output_file, &op, 1, memory_free);
+}
+
+void scale_channel(const char *input_file, const char *output_file,
+                   unsigned char channel, float scale_factor, int memory_free) {
+    struct Operation op = {.type = OP_SCALE, .channel = channel,
+    .scale_factor = scale_factor};
+    run_default(input_file, output_file, &op, 1, memory_free);
+}
+
+void permute_channels(const char *input_file, const char *output_file,
+                      const struct Operation *op, int memory_free) {
+    run_default(input_file, output_file, op, 1, memory_free);
+}
+
+void run_pipeline(const char *input_file, const char *output_file,
+                  const struct Operation *ops, int count, int memory_free) {
+    run_default(input_file, output_file, ops, count, memory_free);
+}
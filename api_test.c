@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filmmaster.h"
+#include <stdint.h>
+
+// Library API check for make test:
+// ./api_test [input] [buffer output] [callback output]
+// runs reverse : scale_channel 1 1.5 through process_buffer (-S) and
+// process_callbacks (serial), for comparison with the runme result, and
+// checks that a header claiming more frames than the buffer is refused.
+
+struct Frames {
+    const unsigned char *input;
+    FILE *output;
+    size_t frame_size;
+};
+
+static int read_frame(unsigned char *frame, int64_t index, void *arg) {
+    struct Frames *f = arg;
+    memcpy(frame, f->input + HEADER_SIZE + index * f->frame_size,
+    f->frame_size);
+    return 0;
+}
+
+static int write_frame(const unsigned char *frame, int64_t index,
+                       void *arg) {
+    struct Frames *f = arg;
+    (void)index;
+    return fwrite(frame, 1, f->frame_size, f->output) != f->frame_size;
+}
+
+static int save(const char *path, const unsigned char *data, size_t size) {
+    FILE *file = fopen(path, "wb");
+    int failed = !file || fwrite(data, 1, size, file) != size;
+    if (file && fclose(file) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        perror("Error writing output file");
+    }
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 4) {
+        printf("Usage: ./api_test [input] [buffer output]"
+        " [callback output]\n");
+        return 1;
+    }
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        perror("Error opening input file");
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    unsigned char *input = (unsigned char *)malloc(size);
+    unsigned char *output = (unsigned char *)malloc(size);
+    if (!input || !output || size < HEADER_SIZE
+    || fread(input, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "Error reading %s\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    struct Operation ops[2];
+    memset(ops, 0, sizeof(ops));
+    ops[0].type = OP_REVERSE;
+    ops[1].type = OP_SCALE;
+    ops[1].channel = 1;
+    ops[1].scale_factor = 1.5f;
+    struct Context *ctx = context_create(NULL, 0);
+    if (!ctx) {
+        return 1;
+    }
+    int failed = process_buffer(ctx, input, output, size, ops, 2, 1) != 0
+    || save(argv[2], output, size) != 0;
+
+    struct Video header;
+    memcpy(&header.frames, input, sizeof(int64_t));
+    header.channels = input[8];
+    header.height = input[9];
+    header.width = input[10];
+    struct Frames frames = {input, fopen(argv[3], "wb"),
+    (size_t)header.channels * header.height * header.width};
+    failed = failed || !frames.output
+    || fwrite(input, 1, HEADER_SIZE, frames.output) != HEADER_SIZE
+    || process_callbacks(ctx, &header, ops, 2, 2, read_frame, write_frame,
+    &frames) != 0;
+    if (frames.output && fclose(frames.output) != 0) {
+        failed = 1;
+    }
+
+    // A frame count whose byte size wraps to zero must not pass the size
+    // check (2^50 frames of a 3x128x128 video)
+    size_t low_bit = frames.frame_size & -frames.frame_size;
+    int64_t huge = (int64_t)(UINT64_MAX / low_bit + 1);
+    memcpy(input, &huge, sizeof(int64_t));
+    if (!failed && process_buffer(ctx, input, output, size, ops, 2, 1) == 0) {
+        fprintf(stderr, "Error: oversized header was accepted\n");
+        failed = 1;
+    }
+    context_destroy(ctx);
+    free(input);
+    free(output);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,7 @@
+read_ns 0.109932
+write_ns 1.124667
+copy_ns 0.635498
+clip_ns 0.183088
+scale_ns 0.296210
+frame_ns 334.761718
+team_ns 17769.000806
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <omp.h>
+
+// Memory-budgeted processing for --mem-limit: the frames go through one
+// buffer of K frames, sized so the buffer and the per-thread scratch stay
+// within the budget. Each batch is read and written with one large call
+// and edited in parallel (except in serial mode). A reversed run reads the
+// batches from the tail backward and reverses the frames inside each one.
+
+// Frames per batch for the budget, or -1 if not even one frame fits
+// beside the scratch
+static int64_t batch_frames(size_t limit, size_t frame_size,
+                            size_t scratch_size, int threads,
+                            int64_t frames) {
+    // Empty frames all fit in one batch
+    if (frame_size == 0) {
+        return frames;
+    }
+    size_t needed = threads * scratch_size + frame_size;
+    if (limit < needed) {
+        printf("Error: --mem-limit too small: needs at least %zu bytes\n",
+        needed);
+        return -1;
+    }
+    int64_t k = (limit - threads * scratch_size) / frame_size;
+    return k < frames ? k : frames;
+}
+
+// Edit one batch in place: reverse its frame order if asked, then apply
+// the stages to every frame
+static int edit_batch(struct Context *ctx, unsigned char *batch, int64_t n,
+                      size_t frame_size, size_t channel_size,
+                      const struct Operation *ops, int count, int reversed,
+                      int memory_free) {
+    int failed = 0;
+    #pragma omp parallel if (memory_free != 2) reduction(|:failed)
+    {
+        int t = omp_get_thread_num();
+        unsigned char *temp_channel = pool_scratch(ctx, t, SCRATCH_CHANNEL,
+        channel_size);
+        unsigned char *temp_frame = reversed ? pool_scratch(ctx, t,
+        SCRATCH_FRAME, frame_size) : NULL;
+        int ready = temp_channel && (!reversed || temp_frame);
+        failed = !ready;
+        if (reversed) {
+            #pragma omp for
+            for (int64_t i = 0; i < n / 2; ++i) {
+                if (!ready) {
+                    continue;
+                }
+                unsigned char *front = batch + i * frame_size;
+                unsigned char *back = batch + (n - 1 - i) * frame_size;
+                memcpy(temp_frame, front, frame_size);
+                memcpy(front, back, frame_size);
+                memcpy(back, temp_frame, frame_size);
+            }
+        }
+        #pragma omp for
+        for (int64_t f = 0; f < n; ++f) {
+            if (ready) {
+                apply_stages(batch + f * frame_size, ops, count,
+                channel_size, temp_channel);
+            }
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+int batch_process(struct Context *ctx, const char *input_file,
+                  const char *output_file, const struct Operation *ops,
+                  int count, int memory_free) {
+    FILE *input = fopen(input_file, "rb");
+    if (!input) {
+        perror("Error opening input file");
+        return -1;
+    }
+    struct Video video;
+    if (read_headerdata(ctx, input, &video) != 0) {
+        fclose(input);
+        return -1;
+    }
+    int reversed = check_stages(ops, count, &video);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        fclose(input);
+        return -1;
+    }
+    size_t channel_size = video.height * video.width;
+    size_t frame_size = video.channels * channel_size;
+    int threads = memory_free == 2 ? 1 : omp_get_max_threads();
+    size_t scratch_size = channel_size + (reversed ? frame_size : 0);
+    int64_t k = batch_frames(ctx->settings.mem_limit, frame_size,
+    scratch_size, threads, video.frames);
+    if (k < 0) {
+        fclose(input);
+        return -1;
+    }
+    FILE *output = fopen(output_file, "wb");
+    if (!output) {
+        perror("Error opening output file");
+        fclose(input);
+        return -1;
+    }
+    write_header(ctx, output, &video);
+
+    unsigned char *batch = pool_reserve(ctx, omp_get_max_threads()) == 0
+    ? pool_scratch(ctx, 0, SCRATCH_RING, k * frame_size) : NULL;
+    int failed = !batch;
+    if (failed) {
+        fprintf(stderr, "Memory allocation failed for batch buffer!\n");
+    }
+
+    for (int64_t done = 0; done < video.frames && !failed; done += k) {
+        int64_t n = video.frames - done < k ? video.frames - done : k;
+        // Reversed runs take the batches from the tail backward
+        int64_t first = reversed ? video.frames - done - n : done;
+        if (reversed && fseek(input, HEADER_SIZE + first * frame_size,
+        SEEK_SET) != 0) {
+            fprintf(stderr, "Error seeking to frame %ld\n", first);
+            failed = 1;
+            break;
+        }
+        // fread and fwrite count no items of size 0
+        if (frame_size > 0
+        && metered_fread(ctx, batch, frame_size, n, input) != (size_t)n) {
+            fprintf(stderr, "Error reading frames %ld to %ld\n", first,
+            first + n - 1);
+            failed = 1;
+            break;
+        }
+        double start = metrics_begin(ctx);
+        if (edit_batch(ctx, batch, n, frame_size, channel_size, ops, count,
+        reversed, memory_free) != 0) {
+            fprintf(stderr, "Memory allocation failed for temp buffer!\n");
+            failed = 1;
+            break;
+        }
+        metrics_end(ctx, STAGE_COMPUTE, start);
+        metrics_count(ctx, 0, 0, n);
+        if (frame_size > 0
+        && metered_fwrite(ctx, batch, frame_size, n, output) != (size_t)n) {
+            fprintf(stderr, "Error writing frames\n");
+            failed = 1;
+        }
+    }
+
+    fclose(input);
+    if (fclose(output) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        return -1;
+    }
+    printf("Video processed in batches of %ld frames and saved to %s\n", k,
+    output_file);
+    return 0;
+}
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+// End-to-end benchmark: generates synthetic videos over a size sweep,
+// runs every operation in every mode through ./runme with warmup and
+// repetitions, and reports throughput, latency percentiles and peak RSS.
+
+#define MAX_SIZES 16
+#define MAX_REPS 1000
+
+struct BenchConfig {
+    long frames[MAX_SIZES];
+    int size_count;
+    int channels, height, width;
+    int reps, warmup;
+    const char *runme;
+    const char *gen;
+    const char *dir;
+    const char *flags;  // extra runme options, e.g. "--mmap"
+    const char *csv;
+    const char *json;
+};
+
+struct BenchResult {
+    const char *op;
+    const char *mode;
+    long frames;
+    double bytes;
+    double p50, p99, mean;
+    long max_rss_kb;
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void print_usage(void) {
+    printf("Usage: ./runbench [--frames 10,100,1000] [--shape CxHxW]"
+    " [--reps N] [--warmup N]\n"
+    "                  [--flags \"--mmap\"] [--dir DIR] [--csv FILE]"
+    " [--json FILE]\n");
+}
+
+// Run argv with stdout/stderr discarded, returns the exit status and
+// stores the wall time and the child's peak RSS
+static int run_timed(char *const argv[], double *seconds, long *max_rss_kb) {
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        return -1;
+    }
+    *seconds = now_seconds() - start;
+    *max_rss_kb = usage.ru_maxrss;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted sample
+static double percentile(const double *sorted, int n, double p) {
+    int rank = (int)(p / 100.0 * n + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[(rank > n ? n : rank) - 1];
+}
+
+static int parse_args(int argc, char *argv[], struct BenchConfig *cfg) {
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            return -1;
+        }
+        if (strcmp(arg, "--frames") == 0) {
+            cfg->size_count = 0;
+            char *copy = strdup(value);
+            for (char *tok = strtok(copy, ","); tok
+            && cfg->size_count < MAX_SIZES; tok = strtok(NULL, ",")) {
+                cfg->frames[cfg->size_count++] = atol(tok);
+            }
+            free(copy);
+        } else if (strcmp(arg, "--shape") == 0) {
+            if (sscanf(value, "%dx%dx%d", &cfg->channels, &cfg->height,
+            &cfg->width) != 3) {
+                return -1;
+            }
+        } else if (strcmp(arg, "--reps") == 0) {
+            cfg->reps = atoi(value);
+        } else if (strcmp(arg, "--warmup") == 0) {
+            cfg->warmup = atoi(value);
+        } else if (strcmp(arg, "--flags") == 0) {
+            cfg->flags = value;
+        } else if (strcmp(arg, "--dir") == 0) {
+            cfg->dir = value;
+        } else if (strcmp(arg, "--csv") == 0) {
+            cfg->csv = value;
+        } else if (strcmp(arg, "--json") == 0) {
+            cfg->json = value;
+        } else if (strcmp(arg, "--runme") == 0) {
+            cfg->runme = value;
+        } else {
+            return -1;
+        }
+        i++;
+    }
+    if (cfg->reps < 1 || cfg->reps > MAX_REPS || cfg->warmup < 0
+    || cfg->size_count == 0 || cfg->channels < 1 || cfg->channels > 3) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct BenchConfig cfg = {
+        .frames = {10, 100, 1000}, .size_count = 3,
+        .channels = 3, .height = 128, .width = 128,
+        .reps = 5, .warmup = 1,
+        .runme = "./runme", .gen = "./gen_video", .dir = "/tmp",
+        .flags = NULL, .csv = "bench.csv", .json = "bench.json",
+    };
+    if (parse_args(argc, argv, &cfg) != 0) {
+        print_usage();
+        return 1;
+    }
+
+    // Keep the channel arguments valid for videos with fewer channels
+    char swap_arg[32], channel_arg[16];
+    int last = cfg.channels - 1;
+    snprintf(swap_arg, sizeof(swap_arg), "0,%d", last < 2 ? last : 2);
+    snprintf(channel_arg, sizeof(channel_arg), "%d", last < 1 ? last : 1);
+    char *ops[][4] = {
+        {"reverse", NULL, NULL, NULL},
+        {"swap_channel", swap_arg, NULL, NULL},
+        {"clip_channel", channel_arg, "[10,200]", NULL},
+        {"scale_channel", channel_arg, "1.5", NULL},
+    };
+    const char *modes[] = {"serial", "-S", "-M"};
+    int op_count = sizeof(ops) / sizeof(ops[0]);
+    int mode_count = sizeof(modes) / sizeof(modes[0]);
+
+    struct BenchResult *results = (struct BenchResult *)calloc(
+    cfg.size_count * op_count * mode_count, sizeof(struct BenchResult));
+    double *times = (double *)malloc(cfg.reps * sizeof(double));
+    if (!results || !times) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return 1;
+    }
+    int result_count = 0;
+
+    char input[512], output[512];
+    snprintf(input, sizeof(input), "%s/bench_in_%d.bin", cfg.dir, getpid());
+    snprintf(output, sizeof(output), "%s/bench_out_%d.bin", cfg.dir,
+    getpid());
+
+    for (int s = 0; s < cfg.size_count; ++s) {
+        char frames[32], ch[8], h[8], w[8];
+        snprintf(frames, sizeof(frames), "%ld", cfg.frames[s]);
+        snprintf(ch, sizeof(ch), "%d", cfg.channels);
+        snprintf(h, sizeof(h), "%d", cfg.height);
+        snprintf(w, sizeof(w), "%d", cfg.width);
+        char *gen_argv[] = {(char *)cfg.gen, input, frames, ch, h, w, NULL};
+        double t;
+        long rss;
+        if (run_timed(gen_argv, &t, &rss) != 0) {
+            fprintf(stderr, "Error generating %s\n", input);
+            return 1;
+        }
+        double bytes = (double)cfg.frames[s] * cfg.channels * cfg.height
+        * cfg.width;
+
+        for (int o = 0; o < op_count; ++o) {
+            for (int m = 0; m < mode_count; ++m) {
+                char *run_argv[16];
+                int n = 0;
+                run_argv[n++] = (char *)cfg.runme;
+                run_argv[n++] = input;
+                run_argv[n++] = output;
+                if (strcmp(modes[m], "serial") != 0) {
+                    run_argv[n++] = (char *)modes[m];
+                }
+                char *flags_copy = cfg.flags ? strdup(cfg.flags) : NULL;
+                for (char *tok = flags_copy ? strtok(flags_copy, " ")
+                : NULL; tok && n < 10; tok = strtok(NULL, " ")) {
+                    run_argv[n++] = tok;
+                }
+                for (int k = 0; k < 4 && ops[o][k]; ++k) {
+                    run_argv[n++] = ops[o][k];
+                }
+                run_argv[n] = NULL;
+
+                struct BenchResult *r = &results[result_count++];
+                r->op = ops[o][0];
+                r->mode = modes[m];
+                r->frames = cfg.frames[s];
+                r->bytes = bytes;
+                int failed = 0;
+                double sum = 0;
+                for (int rep = -cfg.warmup; rep < cfg.reps; ++rep) {
+                    if (run_timed(run_argv, &t, &rss) != 0) {
+                        failed = 1;
+                        break;
+                    }
+                    if (rep >= 0) {
+                        times[rep] = t;
+                        sum += t;
+                        if (rss > r->max_rss_kb) {
+                            r->max_rss_kb = rss;
+                        }
+                    }
+                }
+                free(flags_copy);
+                if (failed) {
+                    fprintf(stderr, "Error running %s %s on %ld frames\n",
+                    r->op, r->mode, r->frames);
+                    // The next run reuses the slot and must not inherit
+                    // its peak RSS
+                    memset(r, 0, sizeof(*r));
+                    result_count--;
+                    continue;
+                }
+                qsort(times, cfg.reps, sizeof(double), compare_double);
+                r->p50 = percentile(times, cfg.reps, 50);
+                r->p99 = percentile(times, cfg.reps, 99);
+                r->mean = sum / cfg.reps;
+                printf("%-14s %-7s %8ld frames  %9.1f MB/s  p50 %.4f s"
+                "  p99 %.4f s  %ld KB\n", r->op, r->mode, r->frames,
+                r->bytes / r->p50 / 1e6, r->p50, r->p99, r->max_rss_kb);
+            }
+        }
+    }
+    unlink(input);
+    unlink(output);
+
+    FILE *csv = cfg.csv ? fopen(cfg.csv, "w") : NULL;
+    if (csv) {
+        fprintf(csv, "op,mode,frames,bytes,mb_per_s,frames_per_s,"
+        "p50_s,p99_s,mean_s,max_rss_kb\n");
+        for (int i = 0; i < result_count; ++i) {
+            struct BenchResult *r = &results[i];
+            fprintf(csv, "%s,%s,%ld,%.0f,%.3f,%.3f,%.6f,%.6f,%.6f,%ld\n",
+            r->op, r->mode, r->frames, r->bytes, r->bytes / r->p50 / 1e6,
+            r->frames / r->p50, r->p50, r->p99, r->mean, r->max_rss_kb);
+        }
+        fclose(csv);
+    }
+    FILE *json = cfg.json ? fopen(cfg.json, "w") : NULL;
+    if (json) {
+        fprintf(json, "{\"reps\": %d, \"warmup\": %d, \"flags\": \"%s\","
+        " \"results\": [\n", cfg.reps, cfg.warmup,
+        cfg.flags ? cfg.flags : "");
+        for (int i = 0; i < result_count; ++i) {
+            struct BenchResult *r = &results[i];
+            fprintf(json, "  {\"op\": \"%s\", \"mode\": \"%s\","
+            " \"frames\": %ld, \"bytes\": %.0f, \"mb_per_s\": %.3f,"
+            " \"frames_per_s\": %.3f, \"p50_s\": %.6f, \"p99_s\": %.6f,"
+            " \"mean_s\": %.6f, \"max_rss_kb\": %ld}%s\n", r->op, r->mode,
+            r->frames, r->bytes, r->bytes / r->p50 / 1e6,
+            r->frames / r->p50, r->p50, r->p99, r->mean, r->max_rss_kb,
+            i + 1 < result_count ? "," : "");
+        }
+        fprintf(json, "]}\n");
+        fclose(json);
+    }
+
+    free(times);
+    free(results);
+    return 0;
+}
@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+// Result cache for --cache=DIR. A job's key hashes its input and
+// everything that decides the output bytes: the stages with their
+// parameters, --frames and --compress. The input is hashed in full, or
+// with --cache-fast by device, inode, size and mtime only. A finished
+// output is stored as DIR/<key>.bin; a later job with the same key gets a
+// reflink or a copy of it and skips the work. Hard links are not used, so
+// --in-place edits of an output can never reach the cache. Entries are
+// touched on every hit, and with --cache-limit the least recently used
+// ones are evicted until the directory fits.
+
+#define HASH_CHUNK (1 << 20)
+#define HASH_PRIME1 0x9E3779B97F4A7C15ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static uint64_t hash_round(uint64_t acc, uint64_t word) {
+    acc += word * HASH_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * HASH_PRIME1;
+}
+
+// Four independent lanes over 8-byte words, so the multiplies overlap
+struct Hasher {
+    uint64_t lanes[4];
+    uint64_t length;
+};
+
+static void hasher_init(struct Hasher *h, uint64_t seed) {
+    for (int i = 0; i < 4; ++i) {
+        h->lanes[i] = seed + i * HASH_PRIME1;
+    }
+    h->length = 0;
+}
+
+// len must be a multiple of 32 except for the last call
+static void hasher_update(struct Hasher *h, const unsigned char *data,
+                          size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        for (int l = 0; l < 4; ++l) {
+            uint64_t word;
+            memcpy(&word, data + i + 8 * l, 8);
+            h->lanes[l] = hash_round(h->lanes[l], word);
+        }
+    }
+    for (; i < len; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, len - i < 8 ? len - i : 8);
+        h->lanes[0] = hash_round(h->lanes[0], word);
+    }
+    h->length += len;
+}
+
+static uint64_t hasher_final(const struct Hasher *h) {
+    uint64_t acc = h->length * HASH_PRIME1;
+    for (int l = 0; l < 4; ++l) {
+        acc = hash_round(acc ^ h->lanes[l], l + 1);
+    }
+    acc ^= acc >> 29;
+    return acc * HASH_PRIME2 ^ (acc >> 32);
+}
+
+static int hash_input(struct Context *ctx, const char *input_file,
+                      uint64_t *digest) {
+    int fd = open(input_file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    struct Hasher h;
+    hasher_init(&h, 1);
+    if (ctx->settings.cache_fast) {
+        uint64_t id[5] = {st.st_dev, st.st_ino, st.st_size,
+        st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+        hasher_update(&h, (const unsigned char *)id, sizeof(id));
+        close(fd);
+        *digest = hasher_final(&h);
+        return 0;
+    }
+    unsigned char *chunk = pool_reserve(ctx, 1) == 0 ? pool_scratch(ctx, 0,
+    SCRATCH_RING, HASH_CHUNK) : NULL;
+    int failed = !chunk;
+    double start = metrics_begin(ctx);
+    for (off_t offset = 0; !failed && offset < st.st_size;
+    offset += HASH_CHUNK) {
+        size_t len = st.st_size - offset < HASH_CHUNK ? st.st_size - offset
+        : HASH_CHUNK;
+        failed = pread_full(fd, chunk, len, offset) != 0;
+        if (!failed) {
+            hasher_update(&h, chunk, len);
+        }
+    }
+    metrics_cache_hash(ctx, st.st_size, start);
+    close(fd);
+    *digest = hasher_final(&h);
+    return failed ? -1 : 0;
+}
+
+int cache_key(struct Context *ctx, const char *input_file,
+              const struct Operation *ops, int count, char *key) {
+    // Piped input cannot be hashed up front, and a view is as cheap to
+    // write as a cache entry
+    if (is_stdio_path(input_file) || ctx->settings.view
+    || is_view(input_file)) {
+        return -1;
+    }
+    uint64_t content;
+    if (hash_input(ctx, input_file, &content) != 0) {
+        return -1;
+    }
+    char job[64 * 16 + 64];
+    int len = snprintf(job, sizeof(job), "frames %ld %ld compress %d",
+    ctx->settings.first_frame, ctx->settings.last_frame,
+    ctx->settings.compress);
+    for (int i = 0; i < count && len < (int)sizeof(job); ++i) {
+        const struct Operation *op = &ops[i];
+        len += snprintf(job + len, sizeof(job) - len,
+        "; %d %d %d %d %d %d %d %d %d %a", op->type, op->ch1, op->ch2,
+        op->perm[0], op->perm[1], op->perm[2], op->perm_len, op->channel,
+        op->min_val << 8 | op->max_val, op->scale_factor);
+    }
+    struct Hasher h;
+    hasher_init(&h, 2);
+    hasher_update(&h, (const unsigned char *)job, len < (int)sizeof(job)
+    ? len : (int)sizeof(job));
+    snprintf(key, CACHE_KEY_SIZE, "%016lx%016lx", (unsigned long)content,
+    (unsigned long)hasher_final(&h));
+    return 0;
+}
+
+// Copy from into a new file at to, as a reflink where the filesystem can
+static int clone_file(struct Context *ctx, const char *from, const char *to) {
+    int in_fd = open(from, O_RDONLY);
+    if (in_fd < 0) {
+        return -1;
+    }
+    int out_fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct stat st;
+    int failed = out_fd < 0 || fstat(in_fd, &st) != 0;
+    if (!failed && ioctl(out_fd, FICLONE, in_fd) != 0) {
+        unsigned char *bounce = pool_reserve(ctx, 1) == 0
+        ? pool_scratch(ctx, 0, SCRATCH_RING, HASH_CHUNK) : NULL;
+        int kernel_copy = 1;
+        failed = !bounce || copy_range(in_fd, 0, out_fd, 0, st.st_size,
+        bounce, HASH_CHUNK, &kernel_copy) != 0;
+    }
+    close(in_fd);
+    if (out_fd >= 0 && close(out_fd) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        unlink(to);
+    }
+    return failed ? -1 : 0;
+}
+
+int cache_fetch(struct Context *ctx, const char *key,
+                const char *output_file) {
+    char entry[PATH_MAX];
+    snprintf(entry, sizeof(entry), "%s/%s.bin", ctx->settings.cache_dir,
+    key);
+    double start = metrics_begin(ctx);
+    int result = access(entry, R_OK) == 0
+    && clone_file(ctx, entry, output_file) == 0 ? 0 : -1;
+    metrics_end(ctx, STAGE_WRITE, start);
+    metrics_cache(ctx, result == 0);
+    if (result == 0) {
+        // Recently used for the eviction order
+        utimensat(AT_FDCWD, entry, NULL, 0);
+        printf("Cache hit: %s copied from %s\n", output_file, entry);
+    }
+    return result;
+}
+
+struct CacheEntry {
+    char name[NAME_MAX + 1];
+    off_t size;
+    struct timespec used;
+};
+
+static int older_first(const void *a, const void *b) {
+    const struct CacheEntry *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    return (x->used.tv_nsec > y->used.tv_nsec)
+    - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+// Remove the least recently used entries until the cache fits its limit
+static void cache_evict(struct Context *ctx) {
+    const char *dir_path = ctx->settings.cache_dir;
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return;
+    }
+    struct CacheEntry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    off_t total = 0;
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        size_t len = strlen(d->d_name);
+        struct stat st;
+        if (len != CACHE_KEY_SIZE - 1 + 4
+        || strcmp(d->d_name + len - 4, ".bin") != 0
+        || fstatat(dirfd(dir), d->d_name, &st, 0) != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            struct CacheEntry *grown = (struct CacheEntry *)realloc(entries,
+            capacity * sizeof(struct CacheEntry));
+            if (!grown) {
+                break;
+            }
+            entries = grown;
+        }
+        snprintf(entries[count].name, sizeof(entries[count].name), "%s",
+        d->d_name);
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+    qsort(entries, count, sizeof(struct CacheEntry), older_first);
+    for (size_t i = 0; i < count && total > (off_t)ctx->settings.cache_limit;
+    ++i) {
+        if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+            total -= entries[i].size;
+        }
+    }
+    closedir(dir);
+    free(entries);
+}
+
+int cache_store(struct Context *ctx, const char *key,
+                const char *output_file) {
+    const char *dir = ctx->settings.cache_dir;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating cache directory");
+        return -1;
+    }
+    // Entries appear whole or not at all, even with jobs racing
+    char temp[PATH_MAX], entry[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s/.%s.XXXXXX", dir, key);
+    snprintf(entry, sizeof(entry), "%s/%s.bin", dir, key);
+    int fd = mkstemp(temp);
+    if (fd >= 0) {
+        fchmod(fd, 0644);
+        close(fd);
+    }
+    if (fd < 0 || clone_file(ctx, output_file, temp) != 0
+    || rename(temp, entry) != 0) {
+        perror("Error storing cache entry");
+        unlink(temp);
+        return -1;
+    }
+    if (ctx->settings.cache_limit > 0) {
+        cache_evict(ctx);
+    }
+    return 0;
+}
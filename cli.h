@@ -0,0 +1,40 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include <stdio.h>
+#include "func.h"
+
+// Upper bound on the number of chained operations
+#define MAX_OPS 16
+// Default and largest io_uring queue depth for --uring
+#define URING_DEPTH 32
+#define MAX_URING_DEPTH 4096
+
+struct Job {  // One runme command line: input output [options] operations
+    const char *input_file;
+    const char *output_file;
+    int mode;  // 0 for -M, 1 for -S, 2 for serial
+    struct Settings settings;
+    const char *metrics_path;  // NULL reports to stderr
+    struct Operation ops[MAX_OPS];
+    int count;
+    int auto_plan;  // --auto: let plan_file choose the mode and threads
+    int threads;    // 0 for the OpenMP default
+};
+
+// main.c
+void print_usage();
+int parse_job(int argc, char *argv[], struct Job *job);
+int plan_job(struct Job *job);
+void report_job(struct Context *ctx, const struct Job *job, FILE *out, double wall_seconds);
+
+// serve.c: --serve daemon and --submit client
+int serve_main(int argc, char *argv[]);
+int submit_main(int argc, char *argv[]);
+
+// manifest.c: --manifest and --dir batch runs
+int batch_main(int argc, char *argv[]);
+
+// split.c: --split, --merge and --shard-test
+int split_main(int argc, char *argv[]);
+#endif
@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <omp.h>
+
+// Compressed container, written with --compress and read whenever an
+// input starts with its magic:
+//
+//   "FMZ1" | 11-byte video header | frame payloads | index | index offset
+//
+// Every frame is coded on its own. Planes after the first are stored as
+// the byte-wise difference from the plane before them, then the frame is
+// run-length coded: a control byte below 128 is followed by that many
+// plus one literal bytes, a control byte c of 128 or more repeats the
+// next byte c - 125 times. The index holds frames + 1 uint64 offsets, so
+// frame f is bytes [index[f], index[f + 1]), and the last 8 bytes of the
+// file give the offset of the index. Frames are processed in blocks:
+// each thread reads, decodes, edits and encodes its own frames, and a
+// reversed chain only walks the index backward.
+
+#define CONTAINER_MAGIC "FMZ1"
+#define MAGIC_SIZE 4
+#define CONTAINER_HEADER (MAGIC_SIZE + HEADER_SIZE)
+// Bytes of decoded frames per block
+#define CODEC_BLOCK_BYTES (8 << 20)
+
+// Largest coded size of len bytes: one control byte per 128 literals
+static size_t coded_bound(size_t len) {
+    return len + len / 128 + 1;
+}
+
+// Delta and run-length code one frame into out, returns the coded size.
+// The frame is left holding the deltas.
+static size_t encode_frame(unsigned char *frame, size_t channel_size,
+                           int channels, unsigned char *out) {
+    for (int c = channels - 1; c > 0; --c) {
+        unsigned char *plane = frame + c * channel_size;
+        const unsigned char *prev = plane - channel_size;
+        for (size_t i = 0; i < channel_size; ++i) {
+            plane[i] -= prev[i];
+        }
+    }
+    size_t len = channels * channel_size;
+    size_t i = 0, n = 0;
+    while (i < len) {
+        size_t run = 1;
+        while (i + run < len && run < 130 && frame[i + run] == frame[i]) {
+            run++;
+        }
+        if (run >= 3) {
+            out[n++] = (unsigned char)(run + 125);
+            out[n++] = frame[i];
+            i += run;
+            continue;
+        }
+        // Literals up to the next run of three or 128 bytes
+        size_t start = i;
+        while (i < len && i - start < 128 && !(i + 2 < len
+        && frame[i] == frame[i + 1] && frame[i] == frame[i + 2])) {
+            i++;
+        }
+        out[n++] = (unsigned char)(i - start - 1);
+        memcpy(out + n, frame + start, i - start);
+        n += i - start;
+    }
+    return n;
+}
+
+// Decode size coded bytes into one frame, -1 if they are corrupt
+static int decode_frame(const unsigned char *in, size_t size,
+                        unsigned char *frame, size_t channel_size,
+                        int channels) {
+    size_t len = channels * channel_size;
+    size_t i = 0, n = 0;
+    while (i < size) {
+        unsigned char control = in[i++];
+        if (control < 128) {
+            size_t literal = control + 1;
+            if (i + literal > size || n + literal > len) {
+                return -1;
+            }
+            memcpy(frame + n, in + i, literal);
+            i += literal;
+            n += literal;
+        } else {
+            size_t run = control - 125;
+            if (i == size || n + run > len) {
+                return -1;
+            }
+            memset(frame + n, in[i++], run);
+            n += run;
+        }
+    }
+    if (n != len) {
+        return -1;
+    }
+    for (int c = 1; c < channels; ++c) {
+        unsigned char *plane = frame + c * channel_size;
+        const unsigned char *prev = plane - channel_size;
+        for (size_t k = 0; k < channel_size; ++k) {
+            plane[k] += prev[k];
+        }
+    }
+    return 0;
+}
+
+int is_container(const char *path) {
+    if (is_stdio_path(path)) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    char magic[MAGIC_SIZE];
+    int found = fd >= 0 && pread_full(fd, magic, MAGIC_SIZE, 0) == 0
+    && memcmp(magic, CONTAINER_MAGIC, MAGIC_SIZE) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return found;
+}
+
+// Read the header and the frame index of a container and check that the
+// index fits the file
+static uint64_t *read_index(int fd, struct Video *video) {
+    unsigned char head[CONTAINER_HEADER];
+    struct stat st;
+    uint64_t index_offset;
+    if (fstat(fd, &st) != 0 || st.st_size < CONTAINER_HEADER + 8
+    || pread_full(fd, head, CONTAINER_HEADER, 0) != 0
+    || parse_header(head + MAGIC_SIZE, video) != 0
+    || video->frames > st.st_size / 8
+    || pread_full(fd, &index_offset, 8, st.st_size - 8) != 0
+    || index_offset + (video->frames + 1) * 8 + 8 != (uint64_t)st.st_size) {
+        return NULL;
+    }
+    uint64_t *index = (uint64_t *)malloc((video->frames + 1) * 8);
+    if (!index || pread_full(fd, index, (video->frames + 1) * 8,
+    index_offset) != 0) {
+        free(index);
+        return NULL;
+    }
+    size_t bound = coded_bound(video->channels * video->height
+    * video->width);
+    int valid = index[0] == CONTAINER_HEADER
+    && index[video->frames] == index_offset;
+    for (int64_t f = 0; valid && f < video->frames; ++f) {
+        valid = index[f] <= index[f + 1] && index[f + 1] - index[f] <= bound;
+    }
+    if (!valid) {
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+int container_process(struct Context *ctx, const char *input_file,
+                      const char *output_file, const struct Operation *ops,
+                      int count, int memory_free) {
+    if (is_stdio_path(input_file) || is_stdio_path(output_file)) {
+        printf("Error: Compressed containers need file paths, not -\n");
+        return -1;
+    }
+    int in_fd = open(input_file, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    int decoding = is_container(input_file);
+    int encoding = ctx->settings.compress;
+    struct Video video;
+    uint64_t *index = NULL;
+    unsigned char head[HEADER_SIZE];
+    double start = metrics_begin(ctx);
+    int failed = decoding ? !(index = read_index(in_fd, &video))
+    : pread_full(in_fd, head, HEADER_SIZE, 0) != 0
+    || parse_header(head, &video) != 0;
+    metrics_end(ctx, STAGE_HEADER, start);
+    if (failed) {
+        fprintf(stderr, "Error: Failed to read video header\n");
+        close(in_fd);
+        return -1;
+    }
+    int reversed = check_stages(ops, count, &video);
+    int64_t first = ctx->settings.first_frame;
+    int64_t last = ctx->settings.last_frame > 0 ? ctx->settings.last_frame
+    : video.frames;
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        failed = 1;
+    } else if (first > last || last > video.frames) {
+        printf("Error: Frames %ld:%ld are outside the video (%ld frames)\n",
+        first, last, video.frames);
+        failed = 1;
+    }
+    int out_fd = failed ? -1 : open(output_file,
+    O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (!failed && out_fd < 0) {
+        perror("Error opening output file");
+        failed = 1;
+    }
+
+    size_t channel_size = video.height * video.width;
+    size_t frame_size = video.channels * channel_size;
+    size_t bound = coded_bound(frame_size);
+    int64_t frames = last - first;
+    int64_t k = frame_size > 0 ? CODEC_BLOCK_BYTES / frame_size : 1;
+    k = k < 1 ? 1 : (k > IOV_MAX ? IOV_MAX : k);
+    // Decoded frames, then one coded slot per frame when encoding
+    unsigned char *block = failed || pool_reserve(ctx,
+    omp_get_max_threads()) != 0 ? NULL : pool_scratch(ctx, 0,
+    SCRATCH_RING, k * (frame_size + (encoding ? bound : 0)));
+    unsigned char *coded = block ? block + k * frame_size : NULL;
+    uint64_t *offsets = encoding && !failed
+    ? (uint64_t *)malloc((frames + 1) * 8) : NULL;
+    size_t *sizes = failed ? NULL : (size_t *)malloc(k * sizeof(size_t));
+    if (!failed && (!block || !sizes || (encoding && !offsets))) {
+        fprintf(stderr, "Memory allocation failed for frame block!\n");
+        failed = 1;
+    }
+
+    // Output header: the range is a video of its own
+    off_t offset = encoding ? CONTAINER_HEADER : HEADER_SIZE;
+    if (!failed) {
+        unsigned char out_head[CONTAINER_HEADER];
+        int64_t out_frames = frames;
+        memcpy(out_head, CONTAINER_MAGIC, MAGIC_SIZE);
+        memcpy(out_head + MAGIC_SIZE, &out_frames, sizeof(int64_t));
+        out_head[MAGIC_SIZE + 8] = video.channels;
+        out_head[MAGIC_SIZE + 9] = video.height;
+        out_head[MAGIC_SIZE + 10] = video.width;
+        unsigned char *h = encoding ? out_head : out_head + MAGIC_SIZE;
+        if (pwrite_full(out_fd, h, offset, 0) != 0) {
+            perror("Error writing output header");
+            failed = 1;
+        }
+        metrics_count(ctx, 0, offset, 0);
+    }
+
+    for (int64_t done = 0; !failed && done < frames; done += k) {
+        int64_t n = frames - done < k ? frames - done : k;
+        uint64_t bytes_read = 0;
+        start = metrics_begin(ctx);
+        #pragma omp parallel if (memory_free != 2) \
+        reduction(|:failed) reduction(+:bytes_read)
+        {
+            int t = omp_get_thread_num();
+            unsigned char *temp_channel = pool_scratch(ctx, t,
+            SCRATCH_CHANNEL, channel_size);
+            unsigned char *input = decoding ? pool_scratch(ctx, t,
+            SCRATCH_FRAME, bound) : NULL;
+            int ready = temp_channel && (!decoding || input);
+            failed = !ready;
+            // Output frame done + j comes from input frame src
+            #pragma omp for schedule(dynamic, 4)
+            for (int64_t j = 0; j < n; ++j) {
+                int64_t src = first + (reversed ? frames - 1 - done - j
+                : done + j);
+                unsigned char *frame = block + j * frame_size;
+                if (!ready) {
+                    continue;
+                }
+                if (decoding) {
+                    size_t size = index[src + 1] - index[src];
+                    if (pread_full(in_fd, input, size, index[src]) != 0
+                    || decode_frame(input, size, frame, channel_size,
+                    video.channels) != 0) {
+                        failed = 1;
+                        continue;
+                    }
+                    bytes_read += size;
+                } else {
+                    if (pread_full(in_fd, frame, frame_size, HEADER_SIZE
+                    + src * frame_size) != 0) {
+                        failed = 1;
+                        continue;
+                    }
+                    bytes_read += frame_size;
+                }
+                apply_stages(frame, ops, count, channel_size, temp_channel);
+                if (encoding) {
+                    sizes[j] = encode_frame(frame, channel_size,
+                    video.channels, coded + j * bound);
+                }
+            }
+        }
+        metrics_end(ctx, STAGE_COMPUTE, start);
+        metrics_count(ctx, bytes_read, 0, n);
+        if (failed) {
+            fprintf(stderr, "Error reading or decoding frames from %ld\n",
+            first + done);
+            break;
+        }
+
+        start = metrics_begin(ctx);
+        size_t written = n * frame_size;
+        if (encoding) {
+            struct iovec iov[IOV_MAX];
+            written = 0;
+            for (int64_t j = 0; j < n; ++j) {
+                offsets[done + j] = offset + written;
+                iov[j].iov_base = coded + j * bound;
+                iov[j].iov_len = sizes[j];
+                written += sizes[j];
+            }
+            failed = pwritev_full(out_fd, iov, (int)n, offset) != 0;
+        } else {
+            failed = pwrite_full(out_fd, block, written, offset) != 0;
+        }
+        metrics_end(ctx, STAGE_WRITE, start);
+        metrics_count(ctx, 0, written, 0);
+        offset += written;
+        if (failed) {
+            perror("Error writing frames");
+        }
+    }
+
+    if (!failed && encoding) {
+        uint64_t index_offset = offset;
+        offsets[frames] = index_offset;
+        failed = pwrite_full(out_fd, offsets, (frames + 1) * 8, offset) != 0
+        || pwrite_full(out_fd, &index_offset, 8, offset + (frames + 1) * 8)
+        != 0;
+        metrics_count(ctx, 0, (frames + 2) * 8, 0);
+        if (failed) {
+            perror("Error writing frame index");
+        }
+    }
+
+    free(index);
+    free(offsets);
+    free(sizes);
+    close(in_fd);
+    if (out_fd >= 0 && close(out_fd) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        return -1;
+    }
+    printf("Video %s and saved to %s\n", encoding ? (decoding ? "recoded"
+    : "compressed") : "decompressed", output_file);
+    return 0;
+}
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// --direct: stream input and output with O_DIRECT so a one-pass job does
+// not fill the page cache. Every transfer uses DIRECT_ALIGN-aligned
+// buffers, offsets and sizes. The 11-byte header leaves the frames
+// unaligned in the file, so frames are taken from a large aligned input
+// window and appended to an aligned output buffer that is flushed in
+// whole blocks; the last block is padded and the file is then truncated
+// to its real size. Reads, edits and writes run in turn on one thread,
+// so this is the slow path, chosen for cache hygiene rather than speed.
+
+#define DIRECT_ALIGN 4096
+#define DIRECT_CHUNK (4 << 20)
+
+#define ALIGN_DOWN(x) ((x) / DIRECT_ALIGN * DIRECT_ALIGN)
+#define ALIGN_UP(x) (((x) + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN)
+
+struct DirectWindow {  // Input bytes [start, start + length) in data
+    unsigned char *data;
+    size_t size;
+    off_t start;
+    size_t length;
+};
+
+// Open with O_DIRECT, or without it on filesystems that refuse it
+static int open_direct(const char *path, int flags, int *direct) {
+    int fd = open(path, flags | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL) {
+        *direct = 0;
+        fd = open(path, flags, 0644);
+    }
+    return fd;
+}
+
+// Read as much of len as the file has, returns the bytes read or -1
+static ssize_t read_upto(int fd, unsigned char *buf, size_t len,
+                         off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Make sure bytes [begin, end) of the input are in the window. Forward
+// runs start the window at begin, reversed runs end it at end, so the
+// next frames in either direction are already there.
+static int window_fill(struct Context *ctx, int fd, struct DirectWindow *w,
+                       off_t begin, off_t end, int reversed) {
+    if (begin >= w->start && end <= w->start + (off_t)w->length) {
+        return 0;
+    }
+    off_t start = ALIGN_DOWN(begin);
+    if (reversed && (off_t)ALIGN_UP(end) > (off_t)w->size) {
+        start = ALIGN_UP(end) - w->size;
+    }
+    double timer = metrics_begin(ctx);
+    ssize_t got = read_upto(fd, w->data, w->size, start);
+    metrics_end(ctx, STAGE_READ, timer);
+    if (got < 0) {
+        return -1;
+    }
+    metrics_count(ctx, got, 0, 0);
+    w->start = start;
+    w->length = got;
+    return end <= start + got ? 0 : -1;
+}
+
+// Write the whole aligned blocks of the output buffer at *offset and
+// move the unaligned rest to its front
+static int flush_blocks(struct Context *ctx, int fd, unsigned char *buf,
+                        size_t *used, off_t *offset) {
+    size_t blocks = ALIGN_DOWN(*used);
+    if (blocks == 0) {
+        return 0;
+    }
+    double timer = metrics_begin(ctx);
+    int failed = pwrite_full(fd, buf, blocks, *offset) != 0;
+    metrics_end(ctx, STAGE_WRITE, timer);
+    metrics_count(ctx, 0, blocks, 0);
+    memmove(buf, buf + blocks, *used - blocks);
+    *used -= blocks;
+    *offset += blocks;
+    return failed ? -1 : 0;
+}
+
+int direct_process(struct Context *ctx, const char *input_file,
+                   const char *output_file, const struct Operation *ops,
+                   int count) {
+    int in_direct = 1, out_direct = 1;
+    int in_fd = open_direct(input_file, O_RDONLY, &in_direct);
+    if (in_fd < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    int out_fd = open_direct(output_file, O_WRONLY | O_CREAT | O_TRUNC,
+    &out_direct);
+    if (out_fd < 0) {
+        perror("Error opening output file");
+        close(in_fd);
+        return -1;
+    }
+    if (!in_direct || !out_direct) {
+        fprintf(stderr, "O_DIRECT is not supported here, using the page"
+        " cache\n");
+    }
+
+    struct DirectWindow window = {0};
+    unsigned char *out = NULL;
+    int failed = 0;
+    if (posix_memalign((void **)&window.data, DIRECT_ALIGN, DIRECT_CHUNK)
+    != 0) {
+        window.data = NULL;
+    }
+    window.size = DIRECT_CHUNK;
+    struct Video video;
+    if (!window.data || window_fill(ctx, in_fd, &window, 0, HEADER_SIZE, 0)
+    != 0 || parse_header(window.data, &video) != 0) {
+        fprintf(stderr, "Error: Failed to read video header\n");
+        failed = 1;
+    }
+    int reversed = failed ? 0 : check_stages(ops, count, &video);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        failed = 1;
+    }
+
+    size_t channel_size = 0, frame_size = 0;
+    if (!failed) {
+        channel_size = video.height * video.width;
+        frame_size = video.channels * channel_size;
+        // The window must hold a whole frame at any alignment
+        size_t need = ALIGN_UP(frame_size) + 2 * DIRECT_ALIGN;
+        if (need > window.size) {
+            free(window.data);
+            window.size = need;
+            if (posix_memalign((void **)&window.data, DIRECT_ALIGN, need)
+            != 0) {
+                window.data = NULL;
+            }
+            window.length = 0;
+        }
+        // Frames are appended while less than a chunk is pending
+        if (posix_memalign((void **)&out, DIRECT_ALIGN, DIRECT_CHUNK
+        + ALIGN_UP(frame_size) + DIRECT_ALIGN) != 0) {
+            out = NULL;
+        }
+        if (!window.data || !out) {
+            fprintf(stderr, "Memory allocation failed for direct I/O!\n");
+            failed = 1;
+        }
+    }
+    unsigned char *temp_channel = pool_reserve(ctx, 1) == 0
+    ? pool_scratch(ctx, 0, SCRATCH_CHANNEL, channel_size) : NULL;
+    if (!temp_channel) {
+        failed = 1;
+    }
+
+    size_t used = 0;
+    off_t written = 0;
+    if (!failed) {
+        memcpy(out, window.data, HEADER_SIZE);
+        used = HEADER_SIZE;
+    }
+    for (int64_t g = 0; !failed && g < video.frames; ++g) {
+        int64_t f = reversed ? video.frames - 1 - g : g;
+        off_t begin = HEADER_SIZE + f * frame_size;
+        if (window_fill(ctx, in_fd, &window, begin, begin + frame_size,
+        reversed) != 0) {
+            fprintf(stderr, "Error reading frame %ld\n", f);
+            failed = 1;
+            break;
+        }
+        double timer = metrics_begin(ctx);
+        // The frame is edited where it will be written from
+        unsigned char *target = out + used;
+        memcpy(target, window.data + (begin - window.start), frame_size);
+        apply_stages(target, ops, count, channel_size, temp_channel);
+        metrics_end(ctx, STAGE_COMPUTE, timer);
+        metrics_count(ctx, 0, 0, 1);
+        used += frame_size;
+        if (used >= DIRECT_CHUNK
+        && flush_blocks(ctx, out_fd, out, &used, &written) != 0) {
+            perror("Error writing output");
+            failed = 1;
+        }
+    }
+
+    if (!failed) {
+        // Pad the tail to a whole block, then cut the file back
+        off_t total = written + used;
+        size_t padded = ALIGN_UP(used);
+        memset(out + used, 0, padded - used);
+        used = padded;
+        if (flush_blocks(ctx, out_fd, out, &used, &written) != 0
+        || ftruncate(out_fd, total) != 0) {
+            perror("Error writing output");
+            failed = 1;
+        }
+    }
+
+    free(window.data);
+    free(out);
+    close(in_fd);
+    if (close(out_fd) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        return -1;
+    }
+    printf("Video processed with direct I/O and saved to %s\n",
+    output_file);
+    return 0;
+}
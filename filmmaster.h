@@ -0,0 +1,125 @@
+#ifndef FILMMASTER_H
+#define FILMMASTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+//maximum values for channels, height and width
+#define MAX_CH 3
+#define MAX_H 128
+#define MAX_W 128
+
+struct Video{   //Header and Frames of Video
+    long frames;
+    unsigned char channels;
+    unsigned char height;
+    unsigned char width;
+    unsigned char *data;
+};
+
+// Size of the on-disk header: frames (int64) + channels + height + width
+#define HEADER_SIZE 11
+
+struct Settings {  // Optional behaviour selected with command line flags
+    int use_mmap;  // --mmap: map input/output instead of going through stdio
+    int populate;  // --populate: prefault the mappings with MAP_POPULATE
+    int copy_range;  // --copy-range: reverse with in-kernel frame copies
+    int in_place;  // --in-place: rewrite only the edited planes of the output
+    int metrics;   // --metrics=json: collect per-stage timings
+    size_t mem_limit;  // --mem-limit: batch frames within this many bytes
+    int batch_frames;  // --batch: frames per -M read/write, 0 sizes to cache
+    int uring_depth;   // --uring: io_uring requests in flight, 0 for stdio
+    int direct;        // --direct: O_DIRECT, bypassing the page cache
+    long first_frame;  // --frames a:b: only frames [a, b) are processed,
+    long last_frame;   // as a video of their own; b = 0 runs to the end
+    int compress;      // --compress: write the indexed compressed container
+    int view;          // --view: record reverse/swap_channel as a view file
+    const char *cache_dir;  // --cache: reuse results stored here, or NULL
+    size_t cache_limit;     // --cache-limit: evict LRU entries beyond it
+    int cache_fast;         // --cache-fast: key inputs on inode and mtime
+};
+
+enum OpType { OP_REVERSE, OP_SWAP, OP_PERMUTE, OP_CLIP, OP_SCALE };
+
+struct Operation {  // One stage of a chained (fused) pipeline
+    enum OpType type;
+    unsigned char ch1, ch2;          // swap_channel with two channels
+    unsigned char perm[MAX_CH];      // swap_channel with a full permutation:
+    unsigned char perm_len;          // output plane k is input plane perm[k]
+    unsigned char channel;           // clip_channel / scale_channel
+    unsigned char min_val, max_val;  // clip_channel
+    float scale_factor;              // scale_channel
+};
+
+// A processing context owns its settings, scratch buffers and metrics.
+// Contexts share no state, so several can run at once in one process;
+// one context must only be used by one call at a time. threads caps the
+// OpenMP team and stream workers, 0 for the OpenMP default.
+struct Context;
+
+struct Context *context_create(const struct Settings *settings, int threads);
+void context_destroy(struct Context *ctx);
+// Change the settings between runs; the scratch buffers stay warm and the
+// metrics start over
+void context_set_settings(struct Context *ctx, const struct Settings *settings);
+// A path of "-" reads input_fd or writes output_fd, stdin and stdout
+// unless set here
+void context_set_stdio(struct Context *ctx, int input_fd, int output_fd);
+
+// Every entry point takes the mode as memory_free (0 = -M, 1 = -S,
+// 2 = serial) and returns 0 on success or -1 after printing the error.
+
+// Whole video files, as the command line tool processes them
+int process_file(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count, int memory_free);
+
+// A whole video (header and frames) already in memory. output must hold
+// size bytes and may be the same buffer as input.
+int process_buffer(struct Context *ctx, const unsigned char *input, unsigned char *output, size_t size, const struct Operation *ops, int count, int memory_free);
+
+// Raw frames in video->data, edited in place
+int process_frames(struct Context *ctx, struct Video *video, const struct Operation *ops, int count, int memory_free);
+
+// Frames pulled from and pushed to the caller one at a time.
+// read_frame fills frame index of the input, write_frame receives output
+// frames in order; either returning nonzero stops the run with -1.
+int process_callbacks(struct Context *ctx, const struct Video *header, const struct Operation *ops, int count, int memory_free,
+                      int (*read_frame)(unsigned char *frame, int64_t index, void *arg),
+                      int (*write_frame)(const unsigned char *frame, int64_t index, void *arg), void *arg);
+
+// Mode planner behind --auto: estimates every mode from the header, the
+// file size, free memory (cgroup limits included), the usable cores and a
+// calibration profile, then picks the cheapest mode that fits in memory.
+// The profile lives in $FM_PROFILE or ~/.filmmaster2000_profile and is
+// measured on first use; calibrate_profile measures it again (NULL for
+// the default path).
+struct Plan {
+    int memory_free;      // chosen mode, 0 = -M, 1 = -S, 2 = serial
+    int threads;          // threads for the chosen mode
+    double seconds;       // its estimated time
+    double estimates[3];  // estimated time of each mode, by memory_free
+};
+
+int plan_file(const char *input_file, const struct Operation *ops, int count, struct Plan *plan);
+int calibrate_profile(const char *path);
+
+// Sharding for runs spread over processes or machines. split_file cuts a
+// video into shards "<prefix>.<i>.bin" of consecutive frames, each with
+// its own header. After each shard (or --frames range) is processed,
+// merge_files joins them in order; reversed joins them last one first,
+// for chains that reverse the frame order.
+int split_file(struct Context *ctx, const char *input_file, const char *prefix, int shards);
+int merge_files(struct Context *ctx, const char *output_file, const char *const *shard_files, int shards, int reversed);
+
+// Views written with --view: a sidecar naming a source video, a frame
+// range, a frame order and a channel permutation. Every entry point reads
+// through a view given as input; materialize_view writes it out as a
+// real video in one pass.
+int materialize_view(struct Context *ctx, const char *view_file, const char *output_file, int memory_free);
+
+// Path-based functions, each run in a fresh context with default settings
+void reverse_video(const char *input_file, const char *output_file, int memory_free);
+void swap_channels(const char *input_file, const char *output_file, unsigned char ch1, unsigned char ch2, int memory_free);
+void clip_channel(const char *input_file, const char *output_file, unsigned char channel, unsigned char min_val, unsigned char max_val, int memory_free);
+void scale_channel(const char *input_file, const char *output_file, unsigned char channel, float scale_factor, int memory_free);
+void permute_channels(const char *input_file, const char *output_file, const struct Operation *op, int memory_free);
+void run_pipeline(const char *input_file, const char *output_file, const struct Operation *ops, int count, int memory_free);
+#endif
@@ -1,168 +1,253 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "func.h"
 #include <stdint.h>
+#include <omp.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
 
-struct Video video;
+// Bytes of frames the -M swap reads per gather-write batch
+#define SWAP_BATCH_BYTES (1 << 20)
 
-void read_headerdata(FILE *input, struct Video *video) {
+static int stream_stages(struct Context *ctx, const struct Video *video,
+                         FILE *input, FILE *output,
+                         const struct Operation *ops, int count,
+                         int reversed);
+
+int read_headerdata(struct Context *ctx, FILE *input, struct Video *video) {
+    double start = metrics_begin(ctx);
     // Read the header data
-    fread(&video->frames, sizeof(int64_t), 1, input);
-    fread(&video->channels, sizeof(unsigned char), 1, input);
-    fread(&video->height, sizeof(unsigned char), 1, input);
-    fread(&video->width, sizeof(unsigned char), 1, input);
+    int64_t frames = 0;
+    size_t got = fread(&frames, sizeof(int64_t), 1, input);
+    got += fread(&video->channels, sizeof(unsigned char), 1, input);
+    got += fread(&video->height, sizeof(unsigned char), 1, input);
+    got += fread(&video->width, sizeof(unsigned char), 1, input);
+    video->frames = frames;
+    video->data = NULL;
+    if (got != 4) {
+        fprintf(stderr, "Error: Failed to read video header\n");
+        return -1;
+    }
 
     // Check the maximum size of the video
-    if (video->channels > MAX_CH ||
+    if (video->frames < 0 || video->channels > MAX_CH ||
     video->height > MAX_H || video->width > MAX_W) {
         fprintf(stderr, "Error: Video size "
         "exceeds maximum limit\n");
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    metrics_end(ctx, STAGE_HEADER, start);
+    metrics_count(ctx, HEADER_SIZE, 0, 0);
+    return 0;
 }
 
-void write_header(FILE *output, const struct Video *video) {
+void write_header(struct Context *ctx, FILE *output,
+                  const struct Video *video) {
+    double start = metrics_begin(ctx);
     // Write header data
     fwrite(&video->frames, sizeof(int64_t), 1, output);
     fwrite(&video->channels, sizeof(unsigned char), 1, output);
     fwrite(&video->height, sizeof(unsigned char), 1, output);
     fwrite(&video->width, sizeof(unsigned char), 1, output);
+    metrics_end(ctx, STAGE_HEADER, start);
+    metrics_count(ctx, 0, HEADER_SIZE, 0);
 }
 
-void reverse_video(const char *input_file, const char *output_file,
-                   int memory_free) {
+int reverse_file(struct Context *ctx, const char *input_file,
+                 const char *output_file, int memory_free) {
+    if (ctx->settings.use_mmap) {
+        struct Operation op = {.type = OP_REVERSE};
+        return mmap_process(ctx, input_file, output_file, &op, 1,
+        memory_free);
+    }
+    if (ctx->settings.copy_range) {
+        return reverse_copy_range(ctx, input_file, output_file);
+    }
+    // -M: the threads reverse disjoint ranges with pread/pwrite, so memory
+    // stays at one range per thread
+    if (memory_free == 0) {
+        struct Operation op = {.type = OP_REVERSE};
+        return parallel_process(ctx, input_file, output_file, &op, 1);
+    }
+
     FILE *input = fopen(input_file, "rb");
     if (!input)     {
         perror("Error opening input file");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    read_headerdata(input, &video);
+    struct Video video;
+    if (read_headerdata(ctx, input, &video) != 0) {
+        fclose(input);
+        return -1;
+    }
     size_t frame_size = video.channels * video.height * video.width;
 
     FILE *output = fopen(output_file, "wb");
     if (!output) {
         perror("Error opening output file");
         fclose(input);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    write_header(output, &video);
+    write_header(ctx, output, &video);
 
-    unsigned char *frame_data = (unsigned char *)malloc(frame_size);
-    if (!frame_data) {
+    // Load all frames into memory for faster processing
+    size_t total_size = video.frames * frame_size;
+    video.data = (unsigned char *)metered_malloc(ctx, total_size);
+    if (!video.data) {
         fprintf(stderr, "Memory allocation failed!\n");
         fclose(input);
         fclose(output);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    if (memory_free == 0) {
-        // Reduce memory usage by processing frames one at
-        // a time in reverse order
-        fseek(input, 0, SEEK_END);
-        int64_t file_size = ftell(input);
-        int64_t header_size = file_size - (video.frames * frame_size);
-
-        for (int64_t i = video.frames - 1; i >= 0; i--) {
-            if (fseek(input, header_size + i * frame_size, SEEK_SET) != 0) {
-                fprintf(stderr, "Error seeking to frame %ld\n", i);
-                free(frame_data);
-                fclose(input);
-                fclose(output);
-                exit(EXIT_FAILURE);
-            }
-            if (fread(frame_data, 1, frame_size, input) != frame_size) {
-                fprintf(stderr, "Error reading frame %ld\n", i);
-                free(frame_data);
-                fclose(input);
-                fclose(output);
-                exit(EXIT_FAILURE);
-            }
-            if (fwrite(frame_data, 1, frame_size, output) != frame_size) {
-                fprintf(stderr, "Error writing frame %ld\n", i);
-                free(frame_data);
-                fclose(input);
-                fclose(output);
-                exit(EXIT_FAILURE);
-            }
-        }
-    } else {
-        // Load all frames into memory for faster processing
-        size_t total_size = video.frames * frame_size;
-        video.data = (unsigned char *)malloc(total_size);
-        if (!video.data) {
-            fprintf(stderr, "Memory allocation failed!\n");
-            free(frame_data);
-            fclose(input);
-            fclose(output);
-            exit(EXIT_FAILURE);
+    metered_fread(ctx, video.data, 1, total_size, input);
+    double compute_start = metrics_begin(ctx);
+    for (int64_t i = 0; i < video.frames / 2; i++) {
+        unsigned char *frame_data_start = &video.data[i * frame_size];
+        unsigned char *frame_data_end = &video.data
+        [(video.frames - 1 - i) * frame_size];
+        for (size_t j = 0; j < frame_size; j++) {
+            unsigned char temp = frame_data_start[j];
+            frame_data_start[j] = frame_data_end[j];
+            frame_data_end[j] = temp;
         }
+    }
+    metrics_end(ctx, STAGE_COMPUTE, compute_start);
 
-        fread(video.data, 1, total_size, input);
-        if (memory_free == 2) {
-            for (int64_t i = 0; i < video.frames / 2; i++) {
-                unsigned char *frame_data_start = &video.data[i * frame_size];
-                unsigned char *frame_data_end = &video.data
-                [(video.frames - 1 - i) * frame_size];
-                for (size_t j = 0; j < frame_size; j++) {
-                    unsigned char temp = frame_data_start[j];
-                    frame_data_start[j] = frame_data_end[j];
-                    frame_data_end[j] = temp;
-                }
-            }
-        } else {
-        // Parallelized frame reversal using OpenMP
-        #pragma omp parallel for
-        for (int64_t i = 0; i < video.frames / 2; i++) {
-            unsigned char *frame_data_start = &video.data[i * frame_size];
-            unsigned char *frame_data_end = &video.data
-            [(video.frames - 1 - i) * frame_size];
-            unsigned char *temp = (unsigned char *)malloc(frame_size);
-        if (!temp) {
-            fprintf(stderr, "Memory allocation failed for temp buffer!\n");
-            exit(EXIT_FAILURE);
-        }
+    if (metered_fwrite(ctx, video.data, 1, total_size, output)
+    != total_size) {
+        fprintf(stderr, "Error writing video data\n");
+        free(video.data);
+        fclose(input);
+        fclose(output);
+        return -1;
+    }
+    free(video.data);
 
-        memcpy(temp, frame_data_start, frame_size);
-        memcpy(frame_data_start, frame_data_end, frame_size);
-        memcpy(frame_data_end, temp, frame_size);
+    metrics_count(ctx, 0, 0, video.frames);
+    fclose(input);
+    fclose(output);
+    printf("Video frames reversed and saved to %s\n", output_file);
+    return 0;
+}
 
-        free(temp);
+// Fill perm so that output plane k is input plane perm[k]. Returns -1 if
+// the swap or permutation stage does not fit the video's channels.
+int stage_permutation(const struct Operation *op, int channels,
+                      unsigned char *perm) {
+    for (int c = 0; c < channels; ++c) {
+        perm[c] = (unsigned char)c;
+    }
+    if (op->type == OP_SWAP) {
+        if (op->ch1 >= channels || op->ch2 >= channels) {
+            return -1;
+        }
+        perm[op->ch1] = op->ch2;
+        perm[op->ch2] = op->ch1;
+        return 0;
+    }
+    // A permutation must name every channel exactly once
+    if (op->perm_len != channels) {
+        return -1;
+    }
+    int seen = 0;
+    for (int c = 0; c < channels; ++c) {
+        if (op->perm[c] >= channels || (seen & (1 << op->perm[c]))) {
+            return -1;
         }
+        seen |= 1 << op->perm[c];
+        perm[c] = op->perm[c];
     }
+    return 0;
+}
 
-        if (fwrite(video.data, 1, total_size, output) != total_size) {
-            fprintf(stderr, "Error writing video data\n");
-            free(video.data);
-            free(frame_data);
-            fclose(output);
-            exit(EXIT_FAILURE);
+// Write all iovecs, continuing after partial writes
+int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + written;
+            iov->iov_len -= written;
         }
-        free(video.data);
     }
+    return 0;
+}
 
-    free(frame_data);
-    fclose(input);
-    fclose(output);
-    printf("Video frames reversed and saved to %s\n", output_file);
+// Emit frames with their planes in permuted order straight from the read
+// buffer. Planes that stay adjacent are merged into one iovec.
+static int write_permuted(int fd, const unsigned char *frames, int64_t count,
+                          const unsigned char *perm, int channels,
+                          size_t channel_size) {
+    struct iovec iov[IOV_MAX];
+    int used = 0;
+    for (int64_t f = 0; f < count; ++f) {
+        const unsigned char *frame = frames + f * channels * channel_size;
+        for (int k = 0; k < channels; ++k) {
+            unsigned char *plane = (unsigned char *)frame
+            + perm[k] * channel_size;
+            if (used > 0 && (unsigned char *)iov[used - 1].iov_base
+            + iov[used - 1].iov_len == plane) {
+                iov[used - 1].iov_len += channel_size;
+                continue;
+            }
+            if (used == IOV_MAX) {
+                if (writev_all(fd, iov, used) != 0) {
+                    return -1;
+                }
+                used = 0;
+            }
+            iov[used].iov_base = plane;
+            iov[used].iov_len = channel_size;
+            used++;
+        }
+    }
+    return used > 0 ? writev_all(fd, iov, used) : 0;
 }
 
-void swap_channels(const char *input_file, const char *output_file,
-                   unsigned char ch1, unsigned char ch2, int memory_free) {
+// Frames are planar, so reordering channels needs no pixel work at all:
+// each batch of frames is read once and written with gather writes that
+// point at the planes in their new order
+int permute_file(struct Context *ctx, const char *input_file,
+                 const char *output_file, const struct Operation *op,
+                 int memory_free) {
+    if (ctx->settings.use_mmap) {
+        return mmap_process(ctx, input_file, output_file, op, 1,
+        memory_free);
+    }
+
     FILE *input = fopen(input_file, "rb");
     if (!input) {
         printf("Error opening input file.\n");
-        return;
+        return -1;
     }
 
-    read_headerdata(input, &video);
+    struct Video video;
+    if (read_headerdata(ctx, input, &video) != 0) {
+        fclose(input);
+        return -1;
+    }
 
-    if (ch1 >= video.channels || ch2 >= video.channels) {
+    unsigned char perm[MAX_CH];
+    if (stage_permutation(op, video.channels, perm) != 0) {
         printf("Error: Invalid channel indices.\n");
         fclose(input);
-        return;
+        return -1;
     }
 
     size_t frame_size = video.channels * video.height * video.width;
@@ -172,199 +257,136 @@ void swap_channels(const char *input_file, const char *output_file,
     if (!output) {
         printf("Error opening output file.\n");
         fclose(input);
-        return;
+        return -1;
     }
 
-    write_header(output, &video);
-
-    unsigned char *temp_channel = (unsigned char *)malloc(channel_size);
-    if (!temp_channel) {
-        printf("Memory allocation for temp channel failed!\n");
-        fclose(input);
-        fclose(output);
-        return;
-    }
+    write_header(ctx, output, &video);
+    fflush(output);
 
+    // Memory-saving mode reads a bounded batch of frames at a time,
+    // performance mode reads the entire video with one call
+    int64_t batch = video.frames;
+    unsigned char *buffer;
     if (memory_free == 0) {
-        // Memory-saving mode: process one frame at a time
-        unsigned char *frame_data = (unsigned char *)malloc(frame_size);
-        if (!frame_data) {
-            printf("Memory allocation for frame data failed!\n");
-            free(temp_channel);
-            fclose(input);
-            fclose(output);
-            return;
+        batch = frame_size > 0 ? SWAP_BATCH_BYTES / frame_size : 1;
+        if (batch < 1) {
+            batch = 1;
         }
-
-        for (int64_t f = 0; f < video.frames; ++f) {
-            fread(frame_data, 1, frame_size, input);
-
-            unsigned char *channel1_data = frame_data + ch1 * channel_size;
-            unsigned char *channel2_data = frame_data + ch2 * channel_size;
-
-            memcpy(temp_channel, channel1_data, channel_size);
-            memcpy(channel1_data, channel2_data, channel_size);
-            memcpy(channel2_data, temp_channel, channel_size);
-
-            fwrite(frame_data, 1, frame_size, output);
-        }
-
-        free(frame_data);
+        buffer = pool_reserve(ctx, 1) == 0 ? pool_scratch(ctx, 0,
+        SCRATCH_FRAME, batch * frame_size) : NULL;
     } else {
-    // Performance mode: load entire video into memory
-    size_t total_size = video.frames * frame_size;
-    video.data = (unsigned char *)malloc(total_size);
-    if (!video.data) {
+        video.data = (unsigned char *)metered_malloc(ctx, video.frames
+        * frame_size);
+        buffer = video.data;
+    }
+    if (!buffer) {
         printf("Memory allocation failed!\n");
-        free(temp_channel);
         fclose(input);
         fclose(output);
-        return;
+        return -1;
     }
 
-    fread(video.data, 1, total_size, input);
-
-    if (memory_free == 2) {
-        // Process frames sequentially
-        for (int64_t f = 0; f < video.frames; ++f) {
-            unsigned char *frame_start = video.data + f * frame_size;
-            unsigned char *channel1_data = frame_start + ch1 * channel_size;
-            unsigned char *channel2_data = frame_start + ch2 * channel_size;
-
-            memcpy(temp_channel, channel1_data, channel_size);
-            memcpy(channel1_data, channel2_data, channel_size);
-            memcpy(channel2_data, temp_channel, channel_size);
+    int failed = 0;
+    for (int64_t f = 0; f < video.frames && !failed; f += batch) {
+        int64_t n = video.frames - f < batch ? video.frames - f : batch;
+        if (metered_fread(ctx, buffer, frame_size, n, input) != (size_t)n) {
+            fprintf(stderr, "Error reading frame %ld\n", f);
+            failed = 1;
+            break;
         }
-    } else {
-        // Parallel processing using OpenMP
-        #pragma omp parallel for
-        for (int64_t f = 0; f < video.frames; ++f) {
-            // 为每个线程分配一个临时通道缓冲区
-            unsigned char *temp_channel = (unsigned char *)malloc(channel_size);
-            if (!temp_channel) {
-                printf("Memory allocation failed for temp_channel!\n");
-                exit(EXIT_FAILURE);
-            }
-
-            unsigned char *frame_start = video.data + f * frame_size;
-            unsigned char *channel1_data = frame_start + ch1 * channel_size;
-            unsigned char *channel2_data = frame_start + ch2 * channel_size;
-
-            // 交换通道数据
-            memcpy(temp_channel, channel1_data, channel_size);
-            memcpy(channel1_data, channel2_data, channel_size);
-            memcpy(channel2_data, temp_channel, channel_size);
-
-            // 释放线程局部的临时缓冲区
-            free(temp_channel);
+        double start = metrics_begin(ctx);
+        if (write_permuted(fileno(output), buffer, n, perm, video.channels,
+        channel_size) != 0) {
+            perror("Error writing frames");
+            failed = 1;
+            break;
         }
+        metrics_end(ctx, STAGE_WRITE, start);
+        metrics_count(ctx, 0, n * frame_size, n);
     }
 
-    // Move fwrite outside the parallel loop to avoid multiple concurrent writes
-    fwrite(video.data, 1, total_size, output);
-
-    free(video.data);
-}
-
-
-    free(temp_channel);
+    if (memory_free != 0) {
+        free(video.data);
+    }
     fclose(input);
     fclose(output);
+    if (failed) {
+        return -1;
+    }
 
     printf("Channels swapped and saved to %s\n", output_file);
+    return 0;
 }
 
-void clip_channel(const char *input_file, const char *output_file,
-                  unsigned char channel, unsigned char min_val,
-                  unsigned char max_val, int memory_free) {
+int clip_file(struct Context *ctx, const char *input_file,
+              const char *output_file, unsigned char channel,
+              unsigned char min_val, unsigned char max_val,
+              int memory_free) {
+    if (ctx->settings.use_mmap) {
+        struct Operation op = {.type = OP_CLIP, .channel = channel,
+        .min_val = min_val, .max_val = max_val};
+        return mmap_process(ctx, input_file, output_file, &op, 1,
+        memory_free);
+    }
+
     FILE *input = fopen(input_file, "rb");
     if (!input) {
         printf("Error opening input file.\n");
-        return;
+        return -1;
+    }
+    struct Video video;
+    if (read_headerdata(ctx, input, &video) != 0) {
+        fclose(input);
+        return -1;
     }
-    read_headerdata(input, &video);
 
     FILE *output = fopen(output_file, "wb");
     if (!output) {
         printf("Error opening output file.\n");
         fclose(input);
-        return;
+        return -1;
     }
-    write_header(output, &video);
+    write_header(ctx, output, &video);
 
     if (channel >= video.channels) {
         printf("Error: Invalid channel index.\n");
         fclose(input);
         fclose(output);
-        return;
+        return -1;
     }
 
     size_t frame_size = video.channels * video.height * video.width;
     size_t channel_size = video.height * video.width;
 
     if (memory_free == 0) {
-        // Memory-free mode: process one frame at a time
-        unsigned char *channel_data = (unsigned char *)malloc(channel_size);
-        if (!channel_data) {
-            printf("Memory allocation failed!\n");
+        // Memory-free mode: stream frames through a bounded ring, with
+        // reading, clipping and writing overlapped on separate threads
+        struct Operation op = {.type = OP_CLIP, .channel = channel,
+        .min_val = min_val, .max_val = max_val};
+        if (stream_stages(ctx, &video, input, output, &op, 1, 0) != 0) {
             fclose(input);
             fclose(output);
-            return;
+            return -1;
         }
 
-        for (int64_t f = 0; f < video.frames; ++f) {
-            for (int ch = 0; ch < video.channels; ++ch) {
-                if (fread(channel_data, 1, channel_size, input)
-                != channel_size) {
-                    printf("Error reading channel data at frame %ld,"
-                    "channel %d\n", f, ch);
-                    free(channel_data);
-                    fclose(input);
-                    fclose(output);
-                    return;
-                }
-
-                // Perform clipping only on the target channel
-                if (ch == channel) {
-                    for (size_t i = 0; i < channel_size; ++i) {
-                        if (channel_data[i] < min_val) {
-                            channel_data[i] = min_val;
-                        } else if (channel_data[i] > max_val) {
-                            channel_data[i] = max_val;
-                        }
-                    }
-                }
-
-                if (fwrite(channel_data, 1, channel_size, output)
-                != channel_size) {
-                    printf("Error writing channel data at frame %ld,"
-                    "channel %d\n", f, ch);
-                    free(channel_data);
-                    fclose(input);
-                    fclose(output);
-                    return;
-                }
-            }
-        }
-
-        free(channel_data);
         fclose(input);
         fclose(output);
         printf("Video processed in memory-free mode"
         "and saved to %s\n", output_file);
     } else {
         size_t total_size = video.frames * frame_size;
-        video.data = (unsigned char *)malloc(total_size);
+        video.data = (unsigned char *)metered_malloc(ctx, total_size);
         if (!video.data) {
             printf("Memory allocation failed!\n");
             fclose(input);
             fclose(output);
-            return;
+            return -1;
         }
 
-        fread(video.data, 1, total_size, input);
+        metered_fread(ctx, video.data, 1, total_size, input);
 
         // Using ielse to choose between serial or parallel processing
+        double compute_start = metrics_begin(ctx);
         if (memory_free == 2) {
             // Original serial processing
             for (int64_t f = 0; f < video.frames; ++f) {
@@ -372,16 +394,7 @@ void clip_channel(const char *input_file, const char *output_file,
                 unsigned char *channel_data = frame_start +
                 channel * channel_size;
 
-                for (int64_t h = 0; h < video.height; ++h) {
-                    for (int64_t w = 0; w < video.width; ++w) {
-                        size_t pixel_idx = h * video.width + w;
-                        if (channel_data[pixel_idx] < min_val) {
-                            channel_data[pixel_idx] = min_val;
-                        } else if (channel_data[pixel_idx] > max_val) {
-                            channel_data[pixel_idx] = max_val;
-                        }
-                    }
-                }
+                clip_plane(channel_data, channel_size, min_val, max_val);
             }
         } else {
             // Parallelized processing using OpenMP
@@ -391,42 +404,49 @@ void clip_channel(const char *input_file, const char *output_file,
                 unsigned char *channel_data = frame_start +
                 channel * channel_size;
 
-                for (int64_t h = 0; h < video.height; ++h) {
-                    for (int64_t w = 0; w < video.width; ++w) {
-                        size_t pixel_idx = h * video.width + w;
-                        if (channel_data[pixel_idx] < min_val) {
-                            channel_data[pixel_idx] = min_val;
-                        } else if (channel_data[pixel_idx] > max_val) {
-                            channel_data[pixel_idx] = max_val;
-                        }
-                    }
-                }
+                clip_plane(channel_data, channel_size, min_val, max_val);
             }
         }
 
-        fwrite(video.data, 1, total_size, output);
+        metrics_end(ctx, STAGE_COMPUTE, compute_start);
+        metrics_count(ctx, 0, 0, video.frames);
+
+        metered_fwrite(ctx, video.data, 1, total_size, output);
         free(video.data);
 
         printf("Video processed and saved to %s\n", output_file);
         fclose(input);
         fclose(output);
     }
+    return 0;
 }
 
-void scale_channel(const char *input_file, const char *output_file,
-                   unsigned char channel, float scale_factor, int memory_free) {
+int scale_file(struct Context *ctx, const char *input_file,
+               const char *output_file, unsigned char channel,
+               float scale_factor, int memory_free) {
+    if (ctx->settings.use_mmap) {
+        struct Operation op = {.type = OP_SCALE, .channel = channel,
+        .scale_factor = scale_factor};
+        return mmap_process(ctx, input_file, output_file, &op, 1,
+        memory_free);
+    }
+
     FILE *input = fopen(input_file, "rb");
     if (!input) {
         printf("Error opening input file.\n");
-        return;
+        return -1;
     }
 
-    read_headerdata(input, &video);
+    struct Video video;
+    if (read_headerdata(ctx, input, &video) != 0) {
+        fclose(input);
+        return -1;
+    }
 
     if (channel >= video.channels) {
         printf("Error: Invalid channel index.\n");
         fclose(input);
-        return;
+        return -1;
     }
 
     size_t frame_size = video.channels * video.height * video.width;
@@ -436,83 +456,46 @@ void scale_channel(const char *input_file, const char *output_file,
     if (!output) {
         printf("Error opening output file.\n");
         fclose(input);
-        return;
+        return -1;
     }
 
-    write_header(output, &video);
+    write_header(ctx, output, &video);
 
-    // Memory-free mode: Process one channel at a time
+    // Memory-free mode: stream frames through a bounded ring, with
+    // reading, scaling and writing overlapped on separate threads
     if (memory_free == 0) {
-        unsigned char *channel_data = (unsigned char *)malloc(channel_size);
-        if (!channel_data) {
-            printf("Memory allocation failed!\n");
+        struct Operation op = {.type = OP_SCALE, .channel = channel,
+        .scale_factor = scale_factor};
+        if (stream_stages(ctx, &video, input, output, &op, 1, 0) != 0) {
             fclose(input);
             fclose(output);
-            return;
+            return -1;
         }
 
-        for (int64_t f = 0; f < video.frames; ++f) {  // Iterate over each frame
-            for (int ch = 0; ch < video.channels; ++ch) {
-                // Iterate over each channel
-                // Read data for the current channel (not the entire frame)
-                if (fread(channel_data, 1, channel_size, input)
-                != channel_size) {
-                    printf("Error reading channel data at frame %ld,"
-                    "channel %d\n", f, ch);
-                    free(channel_data);
-                    fclose(input);
-                    fclose(output);
-                    return;
-                }
-
-                // If the current channel is the target channel,
-                // perform clipping
-                if (ch == channel) {
-                    for (size_t i = 0; i < channel_size; ++i) {
-                        int scaled_value = (int)
-                        (channel_data[i] * scale_factor);
-                        channel_data[i] = (unsigned char)
-                        (scaled_value < 0 ? 0 : (scaled_value
-                        > 255 ? 255 : scaled_value));
-                    }
-                }
-
-                // Write the channel data back to the output file
-                if (fwrite(channel_data, 1, channel_size, output)
-                != channel_size) {
-                    printf("Error writing channel data at frame %ld,"
-                    "channel %d\n", f, ch);
-                    free(channel_data);
-                    fclose(input);
-                    fclose(output);
-                    return;
-                }
-            }
-        }
-
-        free(channel_data);
         printf("Video processed in memory-free"
         "mode and saved to %s\n", output_file);
     } else {
         // Performance mode: Load all data into memory
         size_t total_size = video.frames * frame_size;
-        video.data = (unsigned char *)malloc(total_size);
+        video.data = (unsigned char *)metered_malloc(ctx, total_size);
         if (!video.data) {
             printf("Memory allocation failed!\n");
             fclose(input);
             fclose(output);
-            return;
+            return -1;
         }
 
-        if (fread(video.data, 1, total_size, input) != total_size) {
+        if (metered_fread(ctx, video.data, 1, total_size, input)
+        != total_size) {
             fprintf(stderr, "Error: Failed to read video data.\n");
             free(video.data);
             fclose(input);
             fclose(output);
-            return;
+            return -1;
         }
 
         // Check if we should use parallelization or not
+        double compute_start = metrics_begin(ctx);
         if (memory_free == 2) {
             // Serial mode: process one frame at a time
             for (int64_t f = 0; f < video.frames; ++f) {
@@ -520,11 +503,7 @@ void scale_channel(const char *input_file, const char *output_file,
                 unsigned char *channel_data = frame_start +
                 channel * channel_size;
 
-                for (size_t i = 0; i < channel_size; ++i) {
-                    int scaled_value = (int)(channel_data[i] * scale_factor);
-                    channel_data[i] = (unsigned char)(scaled_value > 255
-                    ? 255 : (scaled_value < 0 ? 0 : scaled_value));
-                }
+                scale_plane(channel_data, channel_size, scale_factor);
             }
         } else {
             // Parallelized mode: process frames in parallel using OpenMP
@@ -534,21 +513,21 @@ void scale_channel(const char *input_file, const char *output_file,
                 unsigned char *channel_data = frame_start +
                 channel * channel_size;
 
-                for (size_t i = 0; i < channel_size; ++i) {
-                    int scaled_value = (int)(channel_data[i] * scale_factor);
-                    channel_data[i] = (unsigned char)(scaled_value > 255
-                    ? 255 : (scaled_value < 0 ? 0 : scaled_value));
-                }
+                scale_plane(channel_data, channel_size, scale_factor);
             }
         }
 
+        metrics_end(ctx, STAGE_COMPUTE, compute_start);
+        metrics_count(ctx, 0, 0, video.frames);
+
         // Write processed data to output file
-        if (fwrite(video.data, 1, total_size, output) != total_size) {
+        if (metered_fwrite(ctx, video.data, 1, total_size, output)
+        != total_size) {
             fprintf(stderr, "Error: Failed to write video data.\n");
             free(video.data);
             fclose(input);
             fclose(output);
-            return;
+            return -1;
         }
 
         free(video.data);
@@ -556,4 +535,239 @@ void scale_channel(const char *input_file, const char *output_file,
     }
     fclose(input);
     fclose(output);
+    return 0;
+}
+
+// Apply every non-reverse stage of a pipeline to one frame in place.
+// Reverse only changes the frame order, so it is handled by the caller.
+void apply_stages(unsigned char *frame, const struct Operation *ops,
+                         int count, size_t channel_size,
+                         unsigned char *temp_channel) {
+    for (int s = 0; s < count; ++s) {
+        const struct Operation *op = &ops[s];
+        if (op->type == OP_SWAP) {
+            if (op->ch1 == op->ch2) {
+                continue;
+            }
+            unsigned char *channel1_data = frame + op->ch1 * channel_size;
+            unsigned char *channel2_data = frame + op->ch2 * channel_size;
+            memcpy(temp_channel, channel1_data, channel_size);
+            memcpy(channel1_data, channel2_data, channel_size);
+            memcpy(channel2_data, temp_channel, channel_size);
+        } else if (op->type == OP_PERMUTE) {
+            // Walk each cycle of the permutation with one temp plane
+            int done = 0;
+            for (int start = 0; start < op->perm_len; ++start) {
+                if ((done & (1 << start)) || op->perm[start] == start) {
+                    continue;
+                }
+                memcpy(temp_channel, frame + start * channel_size,
+                channel_size);
+                int k = start;
+                while (op->perm[k] != start) {
+                    memcpy(frame + k * channel_size,
+                    frame + op->perm[k] * channel_size, channel_size);
+                    done |= 1 << k;
+                    k = op->perm[k];
+                }
+                memcpy(frame + k * channel_size, temp_channel, channel_size);
+                done |= 1 << k;
+            }
+        } else if (op->type == OP_CLIP) {
+            clip_plane(frame + op->channel * channel_size, channel_size,
+            op->min_val, op->max_val);
+        } else if (op->type == OP_SCALE) {
+            scale_plane(frame + op->channel * channel_size, channel_size,
+            op->scale_factor);
+        }
+    }
+}
+
+// Check every stage against the video. Returns -1 if one does not fit,
+// otherwise 1 if the stages reverse the frame order and 0 if not (an even
+// number of reverse stages cancels out).
+int check_stages(const struct Operation *ops, int count,
+                 const struct Video *video) {
+    unsigned char perm[MAX_CH];
+    int reversed = 0;
+    for (int s = 0; s < count; ++s) {
+        if (ops[s].type == OP_REVERSE) {
+            reversed = !reversed;
+        } else if (ops[s].type == OP_SWAP || ops[s].type == OP_PERMUTE) {
+            if (stage_permutation(&ops[s], video->channels, perm) != 0) {
+                return -1;
+            }
+        } else if (ops[s].channel >= video->channels) {
+            return -1;
+        }
+    }
+    return reversed;
+}
+
+struct StageArgs {
+    const struct Operation *ops;
+    int count;
+    size_t channel_size;
+};
+
+static void stage_frame(unsigned char *frame, unsigned char *scratch,
+                        void *arg) {
+    const struct StageArgs *stages = arg;
+    apply_stages(frame, stages->ops, stages->count, stages->channel_size,
+    scratch);
+}
+
+// Stream the rest of the input through the stages with the -M engine,
+// the header must already have been read and written
+static int stream_stages(struct Context *ctx, const struct Video *video,
+                         FILE *input, FILE *output,
+                         const struct Operation *ops, int count,
+                         int reversed) {
+    struct StageArgs stages = {ops, count, video->height * video->width};
+    struct StreamJob job = {0};
+    job.ctx = ctx;
+    job.input = input;
+    job.output = output;
+    job.frames = video->frames;
+    job.frame_size = video->channels * stages.channel_size;
+    job.reversed = reversed;
+    job.batch = ctx->settings.batch_frames;
+    job.scratch_size = stages.channel_size;
+    job.process = stage_frame;
+    job.arg = &stages;
+    return stream_process(&job);
+}
+
+// Run several operations in one pass: every frame is read once, all
+// stages are applied while it is in cache, and it is written once.
+int pipeline_file(struct Context *ctx, const char *input_file,
+                  const char *output_file, const struct Operation *ops,
+                  int count, int memory_free) {
+    if (ctx->settings.use_mmap) {
+        return mmap_process(ctx, input_file, output_file, ops, count,
+        memory_free);
+    }
+
+    FILE *input = fopen(input_file, "rb");
+    if (!input) {
+        printf("Error opening input file.\n");
+        return -1;
+    }
+
+    struct Video video;
+    if (read_headerdata(ctx, input, &video) != 0) {
+        fclose(input);
+        return -1;
+    }
+
+    int reversed = check_stages(ops, count, &video);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        fclose(input);
+        return -1;
+    }
+
+    size_t frame_size = video.channels * video.height * video.width;
+    size_t channel_size = video.height * video.width;
+
+    FILE *output = fopen(output_file, "wb");
+    if (!output) {
+        printf("Error opening output file.\n");
+        fclose(input);
+        return -1;
+    }
+
+    write_header(ctx, output, &video);
+
+    unsigned char *temp_channel = pool_reserve(ctx,
+    omp_get_max_threads()) == 0 ? pool_scratch(ctx, 0, SCRATCH_CHANNEL,
+    channel_size) : NULL;
+    if (!temp_channel) {
+        printf("Memory allocation for temp channel failed!\n");
+        fclose(input);
+        fclose(output);
+        return -1;
+    }
+
+    int failed = 0;
+    if (memory_free == 0) {
+        // Memory-saving mode: stream frames through the bounded ring
+        failed = stream_stages(ctx, &video, input, output, ops, count,
+        reversed) != 0;
+    } else {
+        // Performance mode: load entire video into memory
+        size_t total_size = video.frames * frame_size;
+        video.data = (unsigned char *)metered_malloc(ctx, total_size);
+        if (!video.data) {
+            printf("Memory allocation failed!\n");
+            fclose(input);
+            fclose(output);
+            return -1;
+        }
+
+        if (metered_fread(ctx, video.data, 1, total_size, input)
+        != total_size) {
+            fprintf(stderr, "Error: Failed to read video data.\n");
+            free(video.data);
+            fclose(input);
+            fclose(output);
+            return -1;
+        }
+
+        double compute_start = metrics_begin(ctx);
+        if (memory_free == 2) {
+            for (int64_t f = 0; f < video.frames; ++f) {
+                apply_stages(video.data + f * frame_size, ops, count,
+                channel_size, temp_channel);
+            }
+        } else {
+            // Each thread gets its own temp channel for the swap stages
+            #pragma omp parallel reduction(|:failed)
+            {
+                unsigned char *thread_temp = pool_scratch(ctx,
+                omp_get_thread_num(), SCRATCH_CHANNEL, channel_size);
+                failed = !thread_temp;
+                #pragma omp for
+                for (int64_t f = 0; f < video.frames; ++f) {
+                    if (thread_temp) {
+                        apply_stages(video.data + f * frame_size, ops,
+                        count, channel_size, thread_temp);
+                    }
+                }
+            }
+            if (failed) {
+                printf("Memory allocation failed for temp_channel!\n");
+            }
+        }
+
+        metrics_end(ctx, STAGE_COMPUTE, compute_start);
+        metrics_count(ctx, 0, 0, video.frames);
+
+        // Reversal costs nothing extra: write the frames back to front
+        if (reversed) {
+            for (int64_t f = video.frames - 1; f >= 0; --f) {
+                if (metered_fwrite(ctx, video.data + f * frame_size, 1,
+                frame_size, output) != frame_size) {
+                    fprintf(stderr, "Error writing frame %ld\n", f);
+                    failed = 1;
+                    break;
+                }
+            }
+        } else if (metered_fwrite(ctx, video.data, 1, total_size, output)
+        != total_size) {
+            fprintf(stderr, "Error: Failed to write video data.\n");
+            failed = 1;
+        }
+
+        free(video.data);
+    }
+
+    fclose(input);
+    fclose(output);
+    if (failed) {
+        return -1;
+    }
+    printf("Pipeline of %d operations applied and saved to %s\n",
+    count, output_file);
+    return 0;
 }
@@ -2,23 +2,160 @@
 #define FUNC_H
 
 #include <stdlib.h>
-//maximum values for channels, height and width
-#define MAX_CH 3
-#define MAX_H 128
-#define MAX_W 128
-
-struct Video{   //Header and Frames of Video
-    long frames;
-    unsigned char channels;
-    unsigned char height;
-    unsigned char width;
+#include <stdint.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include "filmmaster.h"
+
+// pool.c: per-thread scratch buffers, allocated once and reused
+enum ScratchKind { SCRATCH_CHANNEL, SCRATCH_FRAME, SCRATCH_RING, SCRATCH_KINDS };
+
+struct PoolBuffer {
     unsigned char *data;
+    size_t size;
+};
+
+struct PoolSlot {  // Buffers owned by one thread
+    struct PoolBuffer buffers[SCRATCH_KINDS];
+};
+
+struct BufferPool {
+    struct PoolSlot *slots;
+    int count;
+    _Atomic size_t in_use;      // bytes currently held by the pool
+    _Atomic size_t high_water;  // largest in_use seen so far
+};
+
+// metrics.c: per-stage timers and byte/frame counters (--metrics=json)
+enum MetricStage { STAGE_HEADER, STAGE_ALLOC, STAGE_READ, STAGE_COMPUTE, STAGE_WRITE, STAGE_COUNT };
+
+struct Metrics {
+    int enabled;
+    _Atomic uint64_t nanos[STAGE_COUNT];  // busy time, summed over threads
+    _Atomic uint64_t bytes_read;
+    _Atomic uint64_t bytes_written;
+    _Atomic uint64_t frames;
+    _Atomic uint64_t cache_hits;    // --cache lookups
+    _Atomic uint64_t cache_misses;
+    _Atomic uint64_t cache_hash_bytes;  // input read to key the cache
+    _Atomic uint64_t cache_hash_nanos;
+};
+
+double metrics_now(void);
+void metrics_reset(struct Context *ctx);
+double metrics_begin(struct Context *ctx);
+void metrics_end(struct Context *ctx, enum MetricStage stage, double start);
+void metrics_count(struct Context *ctx, uint64_t bytes_read, uint64_t bytes_written, uint64_t frames);
+size_t metered_fread(struct Context *ctx, void *buf, size_t size, size_t n, FILE *input);
+size_t metered_fwrite(struct Context *ctx, const void *buf, size_t size, size_t n, FILE *output);
+void *metered_malloc(struct Context *ctx, size_t size);
+void metrics_cache(struct Context *ctx, int hit);
+void metrics_cache_hash(struct Context *ctx, uint64_t bytes, double start);
+void metrics_report(struct Context *ctx, FILE *out, const char *operation, const char *mode, double wall_seconds);
+
+struct Context {  // State of one run, see context_create in api.c
+    struct Settings settings;
+    int threads;  // 0 for omp_get_max_threads()
+    struct BufferPool pool;
+    struct Metrics metrics;
+    int stdio_fds[2];  // what "-" reads from and writes to
+};
+
+int pool_reserve(struct Context *ctx, int slots);
+unsigned char *pool_scratch(struct Context *ctx, int slot, enum ScratchKind kind, size_t size);
+size_t pool_high_water(struct Context *ctx);
+void pool_release(struct Context *ctx);
+
+// func.c: stdio implementations, each returns 0 or -1 like the API
+int read_headerdata(struct Context *ctx, FILE *input, struct Video *video);
+void write_header(struct Context *ctx, FILE *output, const struct Video *video);
+int reverse_file(struct Context *ctx, const char *input_file, const char *output_file, int memory_free);
+int permute_file(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *op, int memory_free);
+int clip_file(struct Context *ctx, const char *input_file, const char *output_file, unsigned char channel, unsigned char min_val, unsigned char max_val, int memory_free);
+int scale_file(struct Context *ctx, const char *input_file, const char *output_file, unsigned char channel, float scale_factor, int memory_free);
+int pipeline_file(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count, int memory_free);
+int stage_permutation(const struct Operation *op, int channels, unsigned char *perm);
+int check_stages(const struct Operation *ops, int count, const struct Video *video);
+void apply_stages(unsigned char *frame, const struct Operation *ops, int count, size_t channel_size, unsigned char *temp_channel);
+struct iovec;
+int writev_all(int fd, struct iovec *iov, int count);
+
+// kernels.c: vectorized per-plane kernels, bit-exact with the scalar code
+void clip_plane(unsigned char *data, size_t n, unsigned char min_val, unsigned char max_val);
+void scale_plane(unsigned char *data, size_t n, float scale_factor);
+const char *simd_kernel_name(void);
+
+// stream.c: reader -> compute workers -> writer over a ring of frame slots
+struct StreamJob {
+    struct Context *ctx;
+    FILE *input;          // positioned at the first frame
+    FILE *output;         // header already written
+    int64_t frames;
+    size_t frame_size;
+    int reversed;         // read the frames back to front
+    size_t scratch_size;  // per-worker scratch buffer handed to process
+    void (*process)(unsigned char *frame, unsigned char *scratch, void *arg);
+    void *arg;
+    int workers;          // compute threads, 0 for the context default
+    int slots;            // ring size in batches, 0 for 2 * workers + 2
+    int batch;            // frames per slot, 0 to size from the L2/L3 caches
 };
 
-void read_headerdata(FILE *input, struct Video *video);
-void write_header(FILE *output, const struct Video *video);
-void reverse_video(const char *input_file, const char *output_file, int memory_free);
-void swap_channels(const char *input_file, const char *output_file, unsigned char ch1, unsigned char ch2, int memory_free);
-void clip_channel(const char *input_file, const char *output_file, unsigned char channel, unsigned char min_val, unsigned char max_val, int memory_free);
-void scale_channel(const char *input_file, const char *output_file, unsigned char channel, float scale_factor, int memory_free);
+int stream_process(const struct StreamJob *job);
+
+// pio.c: positional I/O, safe to use from several threads on one file
+int pread_full(int fd, void *buf, size_t len, off_t offset);
+int pwrite_full(int fd, const void *buf, size_t len, off_t offset);
+int pwritev_full(int fd, struct iovec *iov, int count, off_t offset);
+int copy_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t len, unsigned char *bounce, size_t bounce_size, int *kernel_copy);
+int reverse_copy_range(struct Context *ctx, const char *input_file, const char *output_file);
+// Bytes each -S thread loads, edits and stores in one go
+#define PIO_RANGE_BYTES (1 << 20)
+int parallel_process(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count);
+
+// mmap_io.c
+int mmap_process(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count, int memory_free);
+
+// inplace.c
+int in_place_process(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count, int memory_free);
+void edit_plane(unsigned char *plane, size_t channel_size, const struct Operation *ops, int count, int c);
+
+// pipe.c: "-" as stdin/stdout
+int is_stdio_path(const char *path);
+int pipe_process(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count, int memory_free);
+
+// uring.c: io_uring backend, uring_supported is 0 when it cannot be used
+int uring_supported(void);
+int uring_process(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count);
+
+// direct.c
+int direct_process(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count);
+
+// batch.c
+int batch_process(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count, int memory_free);
+
+// shard.c: --frames
+int range_process(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count, int memory_free);
+
+// codec.c: compressed container, read whenever an input is one
+int is_container(const char *path);
+int container_process(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count, int memory_free);
+
+// view.c: --view sidecars, read through whenever an input is one
+int is_view(const char *path);
+int view_process(struct Context *ctx, const char *input_file, const char *output_file, const struct Operation *ops, int count, int memory_free);
+
+// cache.c: --cache, keys are CACHE_KEY_SIZE - 1 hex digits
+#define CACHE_KEY_SIZE 33
+int cache_key(struct Context *ctx, const char *input_file, const struct Operation *ops, int count, char *key);
+int cache_fetch(struct Context *ctx, const char *key, const char *output_file);
+int cache_store(struct Context *ctx, const char *key, const char *output_file);
+
+// planner.c
+const char *profile_path(void);
+
+// api.c
+int check_settings(const struct Settings *settings);
+int same_file(const char *input_file, const char *output_file);
+int parse_header(const unsigned char *head, struct Video *video);
 #endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+
+// Synthetic video generator for tests and benchmarks:
+// ./gen_video [output] [frames] [channels] [height] [width] (seed)
+
+#define GEN_CHUNK (1 << 20)
+
+int main(int argc, char *argv[]) {
+    if (argc < 6) {
+        printf("Usage: ./gen_video [output] [frames] [channels] [height]"
+        " [width] (seed)\n");
+        return 1;
+    }
+
+    struct Video video;
+    video.frames = atol(argv[2]);
+    int channels = atoi(argv[3]);
+    int height = atoi(argv[4]);
+    int width = atoi(argv[5]);
+    uint64_t seed = argc > 6 ? strtoull(argv[6], NULL, 10) : 1;
+    if (video.frames < 0 || channels < 1 || channels > MAX_CH
+    || height < 1 || height > MAX_H || width < 1 || width > MAX_W) {
+        fprintf(stderr, "Error: Video size exceeds maximum limit\n");
+        return 1;
+    }
+    video.channels = (unsigned char)channels;
+    video.height = (unsigned char)height;
+    video.width = (unsigned char)width;
+
+    FILE *output = fopen(argv[1], "wb");
+    if (!output) {
+        perror("Error opening output file");
+        return 1;
+    }
+    struct Context *ctx = context_create(NULL, 0);
+    if (!ctx) {
+        fclose(output);
+        return 1;
+    }
+    write_header(ctx, output, &video);
+    context_destroy(ctx);
+
+    // xorshift64* keeps the content reproducible for a given seed
+    unsigned char *chunk = (unsigned char *)malloc(GEN_CHUNK);
+    if (!chunk) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        fclose(output);
+        return 1;
+    }
+    uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1;
+    uint64_t remaining = (uint64_t)video.frames * channels * height * width;
+    while (remaining > 0) {
+        size_t n = remaining < GEN_CHUNK ? remaining : GEN_CHUNK;
+        for (size_t i = 0; i < n; i += 8) {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            uint64_t r = state * 0x2545F4914F6CDD1Dull;
+            memcpy(chunk + i, &r, n - i < 8 ? n - i : 8);
+        }
+        if (fwrite(chunk, 1, n, output) != n) {
+            perror("Error writing video data");
+            free(chunk);
+            fclose(output);
+            return 1;
+        }
+        remaining -= n;
+    }
+
+    free(chunk);
+    fclose(output);
+    return 0;
+}
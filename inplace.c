@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+// In-place editing for clip and scale: each op changes one channel plane,
+// so only that plane of every frame is read and written back. The other
+// planes never leave the disk.
+
+// Bring output_file to the same content as input_file. Nothing to do when
+// both name the same file; otherwise the copy is done by the kernel.
+static int prepare_target(struct Context *ctx, const char *input_file,
+                          const char *output_file, off_t size) {
+    struct stat in_st, out_st;
+    if (stat(input_file, &in_st) != 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    if (stat(output_file, &out_st) == 0 && in_st.st_dev == out_st.st_dev
+    && in_st.st_ino == out_st.st_ino) {
+        return 0;
+    }
+
+    int in_fd = open(input_file, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    int out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Error opening output file");
+        close(in_fd);
+        return -1;
+    }
+    size_t bounce_size = 1 << 20;
+    unsigned char *bounce = pool_reserve(ctx, 1) == 0 ? pool_scratch(ctx, 0,
+    SCRATCH_FRAME, bounce_size) : NULL;
+    int kernel_copy = 1;
+    int failed = !bounce || copy_range(in_fd, 0, out_fd, 0, size, bounce,
+    bounce_size, &kernel_copy) != 0;
+    if (failed) {
+        perror("Error copying video");
+    }
+    metrics_count(ctx, size, size, 0);
+    close(in_fd);
+    close(out_fd);
+    return failed ? -1 : 0;
+}
+
+// Apply the ops that target channel c to one plane
+void edit_plane(unsigned char *plane, size_t channel_size,
+                const struct Operation *ops, int count, int c) {
+    for (int i = 0; i < count; ++i) {
+        if (ops[i].channel != c) {
+            continue;
+        }
+        if (ops[i].type == OP_CLIP) {
+            clip_plane(plane, channel_size, ops[i].min_val, ops[i].max_val);
+        } else {
+            scale_plane(plane, channel_size, ops[i].scale_factor);
+        }
+    }
+}
+
+// Read, edit and write back the touched planes of frame f
+static int edit_frame(struct Context *ctx, int fd, int64_t f,
+                      const struct Video *header,
+                      const struct Operation *ops, int count,
+                      unsigned char *plane, const int *touched) {
+    size_t channel_size = header->height * header->width;
+    off_t frame_offset = HEADER_SIZE + f * header->channels * channel_size;
+    for (int c = 0; c < header->channels; ++c) {
+        if (!touched[c]) {
+            continue;
+        }
+        off_t offset = frame_offset + c * channel_size;
+        double start = metrics_begin(ctx);
+        if (pread_full(fd, plane, channel_size, offset) != 0) {
+            return -1;
+        }
+        metrics_end(ctx, STAGE_READ, start);
+        start = metrics_begin(ctx);
+        edit_plane(plane, channel_size, ops, count, c);
+        metrics_end(ctx, STAGE_COMPUTE, start);
+        start = metrics_begin(ctx);
+        if (pwrite_full(fd, plane, channel_size, offset) != 0) {
+            return -1;
+        }
+        metrics_end(ctx, STAGE_WRITE, start);
+        metrics_count(ctx, channel_size, channel_size, 0);
+    }
+    return 0;
+}
+
+// With --mmap the file is mapped shared and the planes are edited through
+// the mapping; only the pages holding touched planes get faulted in and
+// written back
+static int edit_mapped(struct Context *ctx, int fd, const struct Video *header,
+                       const struct Operation *ops, int count,
+                       const int *touched, int memory_free) {
+    size_t channel_size = header->height * header->width;
+    size_t frame_size = header->channels * channel_size;
+    size_t map_size = HEADER_SIZE + header->frames * frame_size;
+    unsigned char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping video");
+        return -1;
+    }
+    madvise(map, map_size, MADV_SEQUENTIAL);
+
+    double start = metrics_begin(ctx);
+    #pragma omp parallel for if (memory_free == 1)
+    for (int64_t f = 0; f < header->frames; ++f) {
+        unsigned char *frame = map + HEADER_SIZE + f * frame_size;
+        for (int c = 0; c < header->channels; ++c) {
+            if (touched[c]) {
+                edit_plane(frame + c * channel_size, channel_size, ops,
+                count, c);
+            }
+        }
+    }
+    metrics_end(ctx, STAGE_COMPUTE, start);
+
+    int failed = msync(map, map_size, MS_SYNC) != 0;
+    if (failed) {
+        perror("Error writing video");
+    }
+    munmap(map, map_size);
+    return failed ? -1 : 0;
+}
+
+int in_place_process(struct Context *ctx, const char *input_file,
+                     const char *output_file, const struct Operation *ops,
+                     int count, int memory_free) {
+    struct Video header;
+    FILE *input = fopen(input_file, "rb");
+    if (!input) {
+        printf("Error opening input file.\n");
+        return -1;
+    }
+    int bad_header = read_headerdata(ctx, input, &header);
+    fclose(input);
+    if (bad_header) {
+        return -1;
+    }
+
+    int touched[MAX_CH] = {0};
+    for (int i = 0; i < count; ++i) {
+        if (ops[i].type != OP_CLIP && ops[i].type != OP_SCALE) {
+            printf("Error: --in-place supports only clip_channel and "
+            "scale_channel.\n");
+            return -1;
+        }
+        if (ops[i].channel >= header.channels) {
+            printf("Error: Invalid channel index.\n");
+            return -1;
+        }
+        touched[ops[i].channel] = 1;
+    }
+
+    size_t channel_size = header.height * header.width;
+    off_t total_size = HEADER_SIZE + header.frames * header.channels
+    * channel_size;
+    struct stat st;
+    if (stat(input_file, &st) != 0 || st.st_size < total_size) {
+        fprintf(stderr, "Error: Input file is shorter than its header "
+        "claims\n");
+        return -1;
+    }
+    if (prepare_target(ctx, input_file, output_file, total_size) != 0) {
+        return -1;
+    }
+
+    int fd = open(output_file, O_RDWR);
+    if (fd < 0) {
+        perror("Error opening output file");
+        return -1;
+    }
+
+    int failed = 0;
+    if (ctx->settings.use_mmap) {
+        failed = edit_mapped(ctx, fd, &header, ops, count, touched,
+        memory_free);
+    } else if (memory_free == 1) {
+        // Frames are disjoint ranges of the file, so the threads can
+        // pread/pwrite them concurrently on one descriptor
+        failed = pool_reserve(ctx, omp_get_max_threads()) != 0;
+        #pragma omp parallel reduction(|:failed)
+        {
+            unsigned char *plane = pool_scratch(ctx,
+            omp_get_thread_num(), SCRATCH_CHANNEL, channel_size);
+            #pragma omp for schedule(static)
+            for (int64_t f = 0; f < header.frames; ++f) {
+                if (failed || !plane || edit_frame(ctx, fd, f, &header, ops,
+                count, plane, touched) != 0) {
+                    failed = 1;
+                }
+            }
+        }
+    } else {
+        unsigned char *plane = pool_reserve(ctx, 1) == 0
+        ? pool_scratch(ctx, 0, SCRATCH_CHANNEL, channel_size) : NULL;
+        failed = !plane;
+        for (int64_t f = 0; f < header.frames && !failed; ++f) {
+            failed = edit_frame(ctx, fd, f, &header, ops, count, plane,
+            touched) != 0;
+        }
+    }
+    metrics_count(ctx, 0, 0, header.frames);
+
+    close(fd);
+    if (failed) {
+        fprintf(stderr, "Error editing %s in place\n", output_file);
+        return -1;
+    }
+    printf("Video edited in place and saved to %s\n", output_file);
+    return 0;
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// Per-call parameters for scale_plane. A scale factor is applied with a
+// 16-bit fixed-point multiply when that provably gives the same bytes as
+// the float code for all 256 inputs, otherwise with a float multiply.
+struct ScaleParams {
+    float factor;
+    int fixed;             // use the fixed-point path
+    int shift;             // input is shifted left by this before mulhi
+    unsigned short mult;   // 16-bit multiplier
+};
+
+// Reference definitions, every vector variant must match these exactly
+static unsigned char clip_value(unsigned char value, unsigned char min_val,
+                                unsigned char max_val) {
+    if (value < min_val) {
+        return min_val;
+    } else if (value > max_val) {
+        return max_val;
+    }
+    return value;
+}
+
+static unsigned char scale_value(unsigned char value, float scale_factor) {
+    int scaled_value = (int)(value * scale_factor);
+    return (unsigned char)(scaled_value > 255
+    ? 255 : (scaled_value < 0 ? 0 : scaled_value));
+}
+
+static void clip_scalar(unsigned char *data, size_t n,
+                        unsigned char min_val, unsigned char max_val) {
+    for (size_t i = 0; i < n; ++i) {
+        data[i] = clip_value(data[i], min_val, max_val);
+    }
+}
+
+static void scale_scalar(unsigned char *data, size_t n,
+                         const struct ScaleParams *p) {
+    for (size_t i = 0; i < n; ++i) {
+        data[i] = scale_value(data[i], p->factor);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+static void clip_sse2(unsigned char *data, size_t n,
+                      unsigned char min_val, unsigned char max_val) {
+    __m128i lo = _mm_set1_epi8((char)min_val);
+    __m128i hi = _mm_set1_epi8((char)max_val);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        v = _mm_min_epu8(_mm_max_epu8(v, lo), hi);
+        _mm_storeu_si128((__m128i *)(data + i), v);
+    }
+    clip_scalar(data + i, n - i, min_val, max_val);
+}
+
+static void scale_sse2(unsigned char *data, size_t n,
+                       const struct ScaleParams *p) {
+    __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    if (p->fixed) {
+        __m128i shift = _mm_cvtsi32_si128(p->shift);
+        __m128i mult = _mm_set1_epi16((short)p->mult);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+            __m128i l = _mm_sll_epi16(_mm_unpacklo_epi8(v, zero), shift);
+            __m128i h = _mm_sll_epi16(_mm_unpackhi_epi8(v, zero), shift);
+            l = _mm_mulhi_epu16(l, mult);
+            h = _mm_mulhi_epu16(h, mult);
+            _mm_storeu_si128((__m128i *)(data + i), _mm_packus_epi16(l, h));
+        }
+    } else {
+        __m128 factor = _mm_set1_ps(p->factor);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+            __m128i w[2] = {_mm_unpacklo_epi8(v, zero),
+                            _mm_unpackhi_epi8(v, zero)};
+            __m128i r[2];
+            for (int k = 0; k < 2; ++k) {
+                __m128i a = _mm_unpacklo_epi16(w[k], zero);
+                __m128i b = _mm_unpackhi_epi16(w[k], zero);
+                // cvtt truncates like the (int) cast, the two saturating
+                // packs then clamp to [0, 255]
+                a = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(a), factor));
+                b = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(b), factor));
+                r[k] = _mm_packs_epi32(a, b);
+            }
+            _mm_storeu_si128((__m128i *)(data + i),
+            _mm_packus_epi16(r[0], r[1]));
+        }
+    }
+    scale_scalar(data + i, n - i, p);
+}
+
+__attribute__((target("avx2")))
+static void clip_avx2(unsigned char *data, size_t n,
+                      unsigned char min_val, unsigned char max_val) {
+    __m256i lo = _mm256_set1_epi8((char)min_val);
+    __m256i hi = _mm256_set1_epi8((char)max_val);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        v = _mm256_min_epu8(_mm256_max_epu8(v, lo), hi);
+        _mm256_storeu_si256((__m256i *)(data + i), v);
+    }
+    clip_sse2(data + i, n - i, min_val, max_val);
+}
+
+// The unpack and pack instructions work within 128-bit lanes, so each
+// lane goes through exactly the SSE2 sequence and byte order is kept
+__attribute__((target("avx2")))
+static void scale_avx2(unsigned char *data, size_t n,
+                       const struct ScaleParams *p) {
+    __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    if (p->fixed) {
+        __m128i shift = _mm_cvtsi32_si128(p->shift);
+        __m256i mult = _mm256_set1_epi16((short)p->mult);
+        for (; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+            __m256i l = _mm256_sll_epi16(_mm256_unpacklo_epi8(v, zero), shift);
+            __m256i h = _mm256_sll_epi16(_mm256_unpackhi_epi8(v, zero), shift);
+            l = _mm256_mulhi_epu16(l, mult);
+            h = _mm256_mulhi_epu16(h, mult);
+            _mm256_storeu_si256((__m256i *)(data + i),
+            _mm256_packus_epi16(l, h));
+        }
+    } else {
+        __m256 factor = _mm256_set1_ps(p->factor);
+        for (; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+            __m256i w[2] = {_mm256_unpacklo_epi8(v, zero),
+                            _mm256_unpackhi_epi8(v, zero)};
+            __m256i r[2];
+            for (int k = 0; k < 2; ++k) {
+                __m256i a = _mm256_unpacklo_epi16(w[k], zero);
+                __m256i b = _mm256_unpackhi_epi16(w[k], zero);
+                a = _mm256_cvttps_epi32(_mm256_mul_ps(
+                _mm256_cvtepi32_ps(a), factor));
+                b = _mm256_cvttps_epi32(_mm256_mul_ps(
+                _mm256_cvtepi32_ps(b), factor));
+                r[k] = _mm256_packs_epi32(a, b);
+            }
+            _mm256_storeu_si256((__m256i *)(data + i),
+            _mm256_packus_epi16(r[0], r[1]));
+        }
+    }
+    scale_sse2(data + i, n - i, p);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void clip_avx512(unsigned char *data, size_t n,
+                        unsigned char min_val, unsigned char max_val) {
+    __m512i lo = _mm512_set1_epi8((char)min_val);
+    __m512i hi = _mm512_set1_epi8((char)max_val);
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(data + i));
+        v = _mm512_min_epu8(_mm512_max_epu8(v, lo), hi);
+        _mm512_storeu_si512((void *)(data + i), v);
+    }
+    clip_avx2(data + i, n - i, min_val, max_val);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void scale_avx512(unsigned char *data, size_t n,
+                         const struct ScaleParams *p) {
+    __m512i zero = _mm512_setzero_si512();
+    size_t i = 0;
+    if (p->fixed) {
+        __m128i shift = _mm_cvtsi32_si128(p->shift);
+        __m512i mult = _mm512_set1_epi16((short)p->mult);
+        for (; i + 64 <= n; i += 64) {
+            __m512i v = _mm512_loadu_si512((const void *)(data + i));
+            __m512i l = _mm512_sll_epi16(_mm512_unpacklo_epi8(v, zero), shift);
+            __m512i h = _mm512_sll_epi16(_mm512_unpackhi_epi8(v, zero), shift);
+            l = _mm512_mulhi_epu16(l, mult);
+            h = _mm512_mulhi_epu16(h, mult);
+            _mm512_storeu_si512((void *)(data + i),
+            _mm512_packus_epi16(l, h));
+        }
+    } else {
+        __m512 factor = _mm512_set1_ps(p->factor);
+        for (; i + 64 <= n; i += 64) {
+            __m512i v = _mm512_loadu_si512((const void *)(data + i));
+            __m512i w[2] = {_mm512_unpacklo_epi8(v, zero),
+                            _mm512_unpackhi_epi8(v, zero)};
+            __m512i r[2];
+            for (int k = 0; k < 2; ++k) {
+                __m512i a = _mm512_unpacklo_epi16(w[k], zero);
+                __m512i b = _mm512_unpackhi_epi16(w[k], zero);
+                a = _mm512_cvttps_epi32(_mm512_mul_ps(
+                _mm512_cvtepi32_ps(a), factor));
+                b = _mm512_cvttps_epi32(_mm512_mul_ps(
+                _mm512_cvtepi32_ps(b), factor));
+                r[k] = _mm512_packs_epi32(a, b);
+            }
+            _mm512_storeu_si512((void *)(data + i),
+            _mm512_packus_epi16(r[0], r[1]));
+        }
+    }
+    scale_avx2(data + i, n - i, p);
+}
+#endif
+
+static void (*clip_kernel)(unsigned char *, size_t, unsigned char,
+                           unsigned char) = clip_scalar;
+static void (*scale_kernel)(unsigned char *, size_t,
+                            const struct ScaleParams *) = scale_scalar;
+static const char *kernel_name = "scalar";
+
+// Pick the widest variant the CPU supports once, before main runs.
+// FM_SIMD=scalar|sse2|avx2|avx512 caps the choice for testing.
+__attribute__((constructor))
+static void select_kernels(void) {
+#ifdef HAVE_X86_KERNELS
+    const char *cap = getenv("FM_SIMD");
+    int level = 3;
+    if (cap && strcmp(cap, "scalar") == 0) {
+        level = 0;
+    } else if (cap && strcmp(cap, "sse2") == 0) {
+        level = 1;
+    } else if (cap && strcmp(cap, "avx2") == 0) {
+        level = 2;
+    }
+
+    __builtin_cpu_init();
+    if (level >= 3 && __builtin_cpu_supports("avx512f")
+    && __builtin_cpu_supports("avx512bw")) {
+        clip_kernel = clip_avx512;
+        scale_kernel = scale_avx512;
+        kernel_name = "avx512";
+    } else if (level >= 2 && __builtin_cpu_supports("avx2")) {
+        clip_kernel = clip_avx2;
+        scale_kernel = scale_avx2;
+        kernel_name = "avx2";
+    } else if (level >= 1 && __builtin_cpu_supports("sse2")) {
+        clip_kernel = clip_sse2;
+        scale_kernel = scale_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *simd_kernel_name(void) {
+    return kernel_name;
+}
+
+void clip_plane(unsigned char *data, size_t n,
+                unsigned char min_val, unsigned char max_val) {
+    // With min > max the reference maps everything below min to min and
+    // the rest to max, which a min/max pair cannot express
+    if (min_val > max_val) {
+        clip_scalar(data, n, min_val, max_val);
+        return;
+    }
+    clip_kernel(data, n, min_val, max_val);
+}
+
+// Choosing the fixed-point multiplier costs a pass over all 256 inputs,
+// so the last choice is remembered per thread
+static _Thread_local struct ScaleParams cached_params;
+static _Thread_local int cached_valid;
+
+static void prepare_scale(struct ScaleParams *p, float scale_factor) {
+    p->factor = scale_factor;
+    p->fixed = 0;
+    p->shift = 0;
+    p->mult = 0;
+
+    // Fixed point computes ((x << shift) * mult) >> 16. The smallest shift
+    // that fits the factor keeps the most precision, and shift <= 7 keeps
+    // the product below 32768 so the signed saturating pack is valid.
+    if (!(scale_factor >= 0.0f && scale_factor < 128.0f)) {
+        return;
+    }
+    int shift = 0;
+    while (scale_factor >= (float)(1 << shift)) {
+        shift++;
+    }
+    double ideal = (double)scale_factor * (double)(1 << (16 - shift));
+    for (int c = 0; c < 2 && !p->fixed; ++c) {
+        uint32_t mult = (uint32_t)ideal + (uint32_t)c;
+        if (mult > 65535) {
+            continue;
+        }
+        int exact = 1;
+        for (int x = 0; x < 256 && exact; ++x) {
+            uint32_t r = ((uint32_t)(x << shift) * mult) >> 16;
+            exact = ((r > 255 ? 255 : r) == scale_value(x, scale_factor));
+        }
+        if (exact) {
+            p->fixed = 1;
+            p->shift = shift;
+            p->mult = (unsigned short)mult;
+        }
+    }
+}
+
+void scale_plane(unsigned char *data, size_t n, float scale_factor) {
+    if (!cached_valid || memcmp(&cached_params.factor, &scale_factor,
+    sizeof(float)) != 0) {
+        prepare_scale(&cached_params, scale_factor);
+        cached_valid = 1;
+    }
+    scale_kernel(data, n, &cached_params);
+}
@@ -2,105 +2,430 @@
 #include <stdlib.h>
 #include <string.h>
 #include "func.h"
+#include "cli.h"
 #include <time.h>
+#include <unistd.h>
 #include <sys/resource.h>
 #include <omp.h>
 
-
 void print_usage() {
-    printf("Usage: ./runme [input] [output] [-S/-M] <operation> [params]\n");
+    printf("Usage: ./runme [input] [output] [-S/-M] [options] <operation>"
+    " [params] [: <operation> [params] ...]\n");
+    printf("       ./runme --serve [socket] [--jobs N] [--queue N]\n");
+    printf("       ./runme --calibrate [profile]\n");
+    printf("       ./runme --manifest [file] [--workers=N]\n");
+    printf("       ./runme --materialize [view] [output] [-S/-M]\n");
+    printf("       ./runme --split [input] [K] [prefix]\n");
+    printf("       ./runme --merge [output] [--reverse] [shard] ...\n");
+    printf("       ./runme --shard-test [input] [output] [K] [-S/-M]"
+    " [options] <operation> ...\n");
+    printf("       ./runme --dir [dir] [pattern] [outdir] [--workers=N]"
+    " <operation> ...\n");
+    printf("       ./runme --submit [socket] [input] [output] [-S/-M]"
+    " [options] <operation> ...\n");
+    printf("Options:\n");
+    printf("  --mmap      memory-map input and output instead of stdio\n");
+    printf("  --populate  prefault the mappings (with --mmap)\n");
+    printf("  --copy-range  reverse with copy_file_range, no user-space"
+    " copies\n");
+    printf("  --in-place    clip/scale only the target plane of the output"
+    " file,\n                which may be the input file itself\n");
+    printf("  --mem-limit=BYTES  process batches of frames within BYTES"
+    " (K, M, G suffixes)\n");
+    printf("  --batch=N     frames per read/write in -M streaming (default:"
+    " sized to L2/L3)\n");
+    printf("  --uring[=N]   io_uring reads and writes, N in flight (default"
+    " 32), falls back\n                to stdio where io_uring is"
+    " unavailable\n");
+    printf("  --direct      O_DIRECT reads and writes that bypass the page"
+    " cache; one\n                thread with no I/O overlap, so slower"
+    " than the default\n");
+    printf("  --cache=DIR   reuse the output of an identical earlier job"
+    " stored in DIR\n");
+    printf("  --cache-limit=BYTES  evict least recently used cache entries"
+    " beyond BYTES\n");
+    printf("  --cache-fast  key the cache on input size, inode and mtime"
+    " instead of content\n");
+    printf("  --view        write reverse/swap_channel as a view file"
+    " that refers to the\n                input instead of a new video\n");
+    printf("  --compress    write the compressed container (compressed"
+    " inputs are\n                detected and decoded)\n");
+    printf("  --frames a:b  process only frames a to b-1 (a: to the end) as"
+    " a video of\n                their own\n");
+    printf("  --auto        pick serial, -S or -M and the thread count from"
+    " a cost model\n");
+    printf("  --metrics=json[:FILE]  per-stage timing report to stderr"
+    " or FILE\n");
 }
 
-int main(int argc, char *argv[]) {
-    double start, end;
-    clock_t start_time = clock();
-    start = omp_get_wtime();
+const char *op_name(const struct Operation *op) {
+    switch (op->type) {
+    case OP_REVERSE:
+        return "reverse";
+    case OP_CLIP:
+        return "clip_channel";
+    case OP_SCALE:
+        return "scale_channel";
+    default:
+        return "swap_channel";
+    }
+}
+
+// Parse one operation and its parameters starting at argv[index].
+// Returns the number of arguments consumed, or -1 on error.
+int parse_operation(int argc, char *argv[], int index, struct Operation *op) {
+    const char *operation = argv[index];
+    memset(op, 0, sizeof(*op));
+
+    if (strcmp(operation, "reverse") == 0) {
+        op->type = OP_REVERSE;
+        return 1;
+    } else if (strcmp(operation, "swap_channel") == 0) {
+        if (argc < index + 2) {
+            printf("Error: Two channels (ch1, ch2) are "
+            "required for the swap operation.\n");
+            return -1;
+        }
+        // Parse ch1 and ch2, expecting the format ‘1,2’, or a full
+        // channel permutation such as ‘2,0,1’.
+        unsigned char perm[MAX_CH];
+        char extra;
+        int parsed = sscanf(argv[index + 1], "%hhu,%hhu,%hhu%c",
+        &perm[0], &perm[1], &perm[2], &extra);
+        if (parsed == 3) {
+            memcpy(op->perm, perm, sizeof(perm));
+            op->perm_len = 3;
+            printf("Parsed Permutation: %hhu,%hhu,%hhu\n",
+            perm[0], perm[1], perm[2]);
+            op->type = OP_PERMUTE;
+            return 2;
+        }
+        // Anything after the channels (parsed == 4) is an error, not a
+        // shorter swap
+        if (parsed == 4 || sscanf(argv[index + 1], "%hhu,%hhu%c", &op->ch1,
+        &op->ch2, &extra) != 2) {
+            printf("Error: Invalid format for channels."
+            "Use ch1,ch2 (e.g., 1,2) or a permutation (e.g., 2,0,1).\n");
+            return -1;
+        }
+        // Output parsed ch1 and ch2 for debugging.
+        printf("Parsed Channels: ch1 = %hhu, ch2 = %hhu\n",
+        op->ch1, op->ch2);
+
+        // Ensure that the parameters are within the valid range
+        printf("Channel 1: %d, Channel 2: %d\n", op->ch1, op->ch2);
+        op->type = OP_SWAP;
+        return 2;
+    } else if (strcmp(operation, "clip_channel") == 0) {
+        if (argc < index + 3) {
+            printf("Error: Channel and range (min, max) are"
+            "required for clipping operation.\n");
+            return -1;
+        }
+        op->channel = (unsigned char)atoi(argv[index + 1]);
+        if (sscanf(argv[index + 2], "[%hhu,%hhu]",
+        &op->min_val, &op->max_val) != 2) {
+            printf("Error: Invalid range format. Use [min,max]"
+            "(e.g., [10,200]).\n");
+            return -1;
+        }
+        printf("Channel: %d, min: %d, max:%d\n",
+        op->channel, op->min_val, op->max_val);
+        op->type = OP_CLIP;
+        return 3;
+    } else if (strcmp(operation, "scale_channel") == 0) {
+        if (argc < index + 3) {
+            printf("Error: Channel and scale factor are"
+            "required for scaling operation.\n");
+            return -1;
+        }
+        op->channel = (unsigned char)atoi(argv[index + 1]);
+        op->scale_factor = atof(argv[index + 2]);
+        printf("Channel: %d\n", op->channel);
+        op->type = OP_SCALE;
+        return 3;
+    }
+    print_usage();
+    return -1;
+}
+
+// "a:b" or "a:" into settings->first_frame and last_frame
+static int parse_frames(const char *text, struct Settings *settings) {
+    char *end;
+    long first = strtol(text, &end, 10);
+    if (end == text || *end != ':' || first < 0) {
+        return -1;
+    }
+    const char *rest = end + 1;
+    long last = 0;
+    if (*rest != '\0') {
+        last = strtol(rest, &end, 10);
+        if (end == rest || *end != '\0' || last <= first) {
+            return -1;
+        }
+    }
+    settings->first_frame = first;
+    settings->last_frame = last;
+    return 0;
+}
+
+// Parse a byte count with an optional K, M or G suffix (powers of 1024)
+static int parse_size(const char *text, size_t *size) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || text[0] == '-') {
+        return -1;
+    }
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
+    }
+    if (shift > 0) {
+        end++;
+    }
+    if (*end != '\0' || value == 0 || value > (SIZE_MAX >> shift)) {
+        return -1;
+    }
+    *size = (size_t)value << shift;
+    return 0;
+}
+
+// Parse "input output [options] operations" from argv[1] on.
+// Returns 0, or -1 after printing the error.
+int parse_job(int argc, char *argv[], struct Job *job) {
+    memset(job, 0, sizeof(*job));
     if (argc < 4) {
         print_usage();
-        return 1;
+        return -1;
     }
 
-    const char *input_file = argv[1];
-    const char *output_file = argv[2];
+    job->input_file = argv[1];
+    job->output_file = argv[2];
     // Default is -M (memory optimisation),
     // if there is no -S/-M in the parameters,
     // flag variable: 0 for memory optimisation, 1 for performance optimisation.
-    int mode = 2;
+    job->mode = 2;
 
-    // Check if -s or -m is specified
+    // Check if -S/-M or any backend option is specified,
+    // the operation starts after the last option
     int operation_start_index = 3;
-    if (argc > 4 && (strcmp(argv[3], "-S") == 0
-    || strcmp(argv[3], "-M") == 0)) {
-        if (strcmp(argv[3], "-S") == 0) {
-            mode = 1;  // Performance optimization
-        } else if (strcmp(argv[3], "-M") == 0) {
-            mode = 0;  // Memory optimization
+    while (operation_start_index < argc - 1
+    && argv[operation_start_index][0] == '-') {
+        const char *option = argv[operation_start_index];
+        if (strcmp(option, "-S") == 0) {
+            job->mode = 1;  // Performance optimization
+        } else if (strcmp(option, "-M") == 0) {
+            job->mode = 0;  // Memory optimization
+        } else if (strcmp(option, "--mmap") == 0) {
+            job->settings.use_mmap = 1;
+        } else if (strcmp(option, "--populate") == 0) {
+            job->settings.populate = 1;
+        } else if (strcmp(option, "--copy-range") == 0) {
+            job->settings.copy_range = 1;
+        } else if (strcmp(option, "--in-place") == 0) {
+            job->settings.in_place = 1;
+        } else if (strncmp(option, "--mem-limit=", 12) == 0) {
+            if (parse_size(option + 12, &job->settings.mem_limit) != 0) {
+                printf("Error: Invalid memory limit %s\n", option + 12);
+                return -1;
+            }
+        } else if (strncmp(option, "--batch=", 8) == 0) {
+            job->settings.batch_frames = atoi(option + 8);
+            if (job->settings.batch_frames < 1) {
+                printf("Error: Invalid batch size %s\n", option + 8);
+                return -1;
+            }
+        } else if (strncmp(option, "--uring", 7) == 0
+        && (option[7] == '\0' || option[7] == '=')) {
+            // --uring keeps 32 requests in flight, --uring=N sets the depth
+            job->settings.uring_depth = option[7] == '=' ? atoi(option + 8)
+            : URING_DEPTH;
+            if (job->settings.uring_depth < 1
+            || job->settings.uring_depth > MAX_URING_DEPTH) {
+                printf("Error: io_uring depth must be 1 to %d\n",
+                MAX_URING_DEPTH);
+                return -1;
+            }
+        } else if (strcmp(option, "--direct") == 0) {
+            job->settings.direct = 1;
+        } else if (strncmp(option, "--cache=", 8) == 0) {
+            job->settings.cache_dir = option + 8;
+        } else if (strncmp(option, "--cache-limit=", 14) == 0) {
+            if (parse_size(option + 14, &job->settings.cache_limit) != 0) {
+                printf("Error: Invalid cache limit %s\n", option + 14);
+                return -1;
+            }
+        } else if (strcmp(option, "--cache-fast") == 0) {
+            job->settings.cache_fast = 1;
+        } else if (strcmp(option, "--view") == 0) {
+            job->settings.view = 1;
+        } else if (strcmp(option, "--compress") == 0) {
+            job->settings.compress = 1;
+        } else if (strcmp(option, "--frames") == 0) {
+            // --frames a:b takes frames [a, b), --frames a: runs to the end
+            if (parse_frames(argv[++operation_start_index],
+            &job->settings) != 0) {
+                printf("Error: Invalid frame range %s\n",
+                argv[operation_start_index]);
+                return -1;
+            }
+        } else if (strcmp(option, "--auto") == 0) {
+            job->auto_plan = 1;
+        } else if (strncmp(option, "--metrics=json", 14) == 0
+        && (option[14] == '\0' || option[14] == ':')) {
+            // --metrics=json reports to stderr, --metrics=json:FILE to FILE
+            job->settings.metrics = 1;
+            job->metrics_path = option[14] == ':' ? option + 15 : NULL;
+        } else {
+            printf("Error: Unknown option %s\n", option);
+            print_usage();
+            return -1;
+        }
+        operation_start_index++;
+    }
+
+    if (check_settings(&job->settings) != 0) {
+        return -1;
+    }
+    // Both run on one thread, so a request for the -S team is an error
+    if (job->mode == 1 && (job->settings.uring_depth > 0
+    || job->settings.direct)) {
+        printf("Error: %s cannot be combined with -S\n",
+        job->settings.direct ? "--direct" : "--uring");
+        return -1;
+    }
+
+    // Operations may be chained with ":" and are then fused into one pass,
+    // e.g. swap_channel 0,2 : clip_channel 1 [10,200] : scale_channel 1 1.5
+    int index = operation_start_index;
+    while (index < argc) {
+        if (job->count == MAX_OPS) {
+            printf("Error: At most %d operations can be chained.\n",
+            MAX_OPS);
+            return -1;
+        }
+        int used = parse_operation(argc, argv, index, &job->ops[job->count]);
+        if (used < 0) {
+            return -1;
+        }
+        job->count++;
+        index += used;
+        if (index < argc) {
+            if (strcmp(argv[index], ":") != 0 || index + 1 == argc) {
+                print_usage();
+                return -1;
+            }
+            index++;
         }
-        // If -s/-m is specified, operation starts from the 4th argument
-        operation_start_index = 4;
     }
+    return 0;
+}
 
-    const char *operation = argv[operation_start_index];
+// Replace the job's mode with the planner's choice
+int plan_job(struct Job *job) {
+    struct Plan plan;
+    if (plan_file(job->input_file, job->ops, job->count, &plan) != 0) {
+        printf("Error: Could not plan %s, keeping the default mode\n",
+        job->input_file);
+        return -1;
+    }
+    job->mode = plan.memory_free;
+    job->threads = plan.threads;
+    printf("Auto plan: %s with %d threads, estimated %.6f s (serial %.6f,"
+    " -S %.6f, -M %.6f)\n", plan.memory_free == 2 ? "serial"
+    : (plan.memory_free == 1 ? "-S" : "-M"), plan.threads, plan.seconds,
+    plan.estimates[2], plan.estimates[1], plan.estimates[0]);
+    return 0;
+}
 
-    unsigned char ch1, ch2, channel;
-    unsigned char min_val, max_val;
-    float scale_factor;
+// Write the --metrics=json report, named after the job's operations,
+// e.g. swap_channel+reverse
+void report_job(struct Context *ctx, const struct Job *job, FILE *out,
+                double wall_seconds) {
+    char names[MAX_OPS * 16] = "";
+    for (int i = 0; i < job->count; ++i) {
+        if (i > 0) {
+            strcat(names, "+");
+        }
+        strcat(names, op_name(&job->ops[i]));
+    }
+    const char *mode_name = job->mode == 1 ? "-S" : (job->mode == 0 ? "-M"
+    : "serial");
+    metrics_report(ctx, out, names, mode_name, wall_seconds);
+}
 
-    if (strcmp(operation, "reverse") == 0) {
-        reverse_video(input_file, output_file, mode);
-    } else if (strcmp(operation, "swap_channel") == 0) {
-        if (argc < operation_start_index + 2) {
-            printf("Error: Two channels (ch1, ch2) are "
-            "required for the swap operation.\n");
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        return serve_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--submit") == 0) {
+        return submit_main(argc, argv);
+    }
+    if (argc > 1 && (strcmp(argv[1], "--manifest") == 0
+    || strcmp(argv[1], "--dir") == 0)) {
+        return batch_main(argc, argv);
+    }
+    if (argc > 1 && (strcmp(argv[1], "--split") == 0
+    || strcmp(argv[1], "--merge") == 0
+    || strcmp(argv[1], "--shard-test") == 0)) {
+        return split_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--materialize") == 0) {
+        // ./runme --materialize view output [-S/-M]
+        int mode = 2;
+        if (argc == 5 && (strcmp(argv[4], "-S") == 0
+        || strcmp(argv[4], "-M") == 0)) {
+            mode = argv[4][1] == 'S' ? 1 : 0;
+        } else if (argc != 4) {
+            print_usage();
             return 1;
         }
-        // Parse ch1 and ch2, expecting the format ‘1,2’.
-        if (sscanf(argv[operation_start_index + 1],
-        "%hhu,%hhu", &ch1, &ch2) != 2) {
-            printf("Error: Invalid format for channels."
-            "Use ch1,ch2 (e.g., 1,2).\n");
+        struct Context *ctx = context_create(NULL, 0);
+        int result = ctx ? materialize_view(ctx, argv[2], argv[3], mode) : -1;
+        context_destroy(ctx);
+        return result == 0 ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "--calibrate") == 0) {
+        const char *path = argc > 2 ? argv[2] : profile_path();
+        if (calibrate_profile(path) != 0) {
             return 1;
         }
-        // Output parsed ch1 and ch2 for debugging.
-        printf("Parsed Channels: ch1 = %hhu, ch2 = %hhu\n", ch1, ch2);
+        printf("Profile saved to %s\n", path);
+        return 0;
+    }
 
-        // Ensure that the parameters are within the valid range
-        printf("Channel 1: %d, Channel 2: %d\n", ch1, ch2);
-        swap_channels(input_file, output_file, ch1, ch2, mode);
-    } else if (strcmp(operation, "clip_channel") == 0) {
-        if (argc < operation_start_index + 3) {
-            printf("Error: Channel and range (min, max) are"
-            "required for clipping operation.\n");
+    // With the video going to stdout, every message goes to stderr
+    int video_fd = STDOUT_FILENO;
+    if (argc > 2 && strcmp(argv[2], "-") == 0) {
+        video_fd = dup(STDOUT_FILENO);
+        if (video_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("Error redirecting stdout");
             return 1;
         }
-        channel = (unsigned char)
-        atoi(argv[operation_start_index + 1]);
-        if (sscanf(argv[operation_start_index + 2],
-        "[%hhu,%hhu]", &min_val, &max_val) != 2) {
-        printf("Error: Invalid range format. Use [min,max]"
-        "(e.g., [10,200]).\n");
+    }
+
+    double start, end;
+    clock_t start_time = clock();
+    start = omp_get_wtime();
+    struct Job job;
+    if (parse_job(argc, argv, &job) != 0) {
         return 1;
     }
-        printf("Channel: %d, min: %d, max:%d\n", channel, min_val, max_val);
-        clip_channel(input_file, output_file, channel,
-        min_val, max_val, mode);
+    if (job.auto_plan) {
+        plan_job(&job);
+    }
 
-    } else if (strcmp(operation, "scale_channel") == 0) {
-        if (argc < operation_start_index + 2) {
-            printf("Error: Channel and scale factor are"
-            "required for scaling operation.\n");
-            return 1;
-        }
-        channel = (unsigned char)
-        atoi(argv[operation_start_index + 1]);
-        scale_factor = atof(argv[operation_start_index + 2]);
-        printf("Channel: %d\n", channel);
-        scale_channel(input_file, output_file, channel,
-        scale_factor, mode);
-    } else {
-        print_usage();
+    struct Context *ctx = context_create(&job.settings, job.threads);
+    if (!ctx) {
         return 1;
     }
+    context_set_stdio(ctx, STDIN_FILENO, video_fd);
+    int result = process_file(ctx, job.input_file, job.output_file, job.ops,
+    job.count, job.mode);
     clock_t end_time = clock();
     end = omp_get_wtime();
     printf("OpenMp Time taken: %f seconds\n", end - start);
@@ -109,5 +434,21 @@ int main(int argc, char *argv[]) {
     struct rusage usage;
     getrusage(RUSAGE_SELF, &usage);
     printf("Memory usage: %ld KB\n", usage.ru_maxrss);
-    return 0;
+    printf("Scratch pool high-water: %zu KB\n",
+    pool_high_water(ctx) / 1024);
+
+    if (job.settings.metrics) {
+        FILE *report = job.metrics_path ? fopen(job.metrics_path, "w")
+        : stderr;
+        if (!report) {
+            perror("Error opening metrics file");
+        } else {
+            report_job(ctx, &job, report, end - start);
+            if (report != stderr) {
+                fclose(report);
+            }
+        }
+    }
+    context_destroy(ctx);
+    return result == 0 ? 0 : 1;
 }
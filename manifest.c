@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include "cli.h"
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <omp.h>
+
+// Batch mode: many jobs, from a manifest or a directory, on one pool of
+// worker threads. Every worker owns a deque of tasks. A job task opens the
+// files and pushes one range task per block of frames onto its worker's
+// deque; the worker pops its newest task, and idle workers steal the
+// oldest task from another deque before starting a new job. Small clips
+// thus run one per core while a large file is shared out by range. All
+// workers draw their scratch from one shared context.
+
+// Bytes of frames per range task
+#define RANGE_BYTES (1 << 20)
+
+struct BatchJob {
+    struct Job job;
+    char *line;                 // owns the strings job points into
+    int in_fd, out_fd;
+    struct Video video;
+    int reversed;
+    int64_t range;              // frames per range task
+    _Atomic int64_t left;       // range tasks not finished yet
+    _Atomic int failed;
+};
+
+struct Task {
+    struct BatchJob *job;
+    int64_t first;              // first frame, -1 for the job setup task
+};
+
+struct Deque {
+    pthread_mutex_t lock;
+    struct Task *tasks;         // tasks[head, tail)
+    size_t head, tail, capacity;
+};
+
+struct Batch {
+    struct Context *ctx;
+    struct BatchJob *jobs;
+    int count;
+    _Atomic int next_job;
+    _Atomic int64_t pending;    // tasks queued or running
+    _Atomic int done, failed;
+    struct Deque *deques;
+    int workers;
+};
+
+static int deque_push(struct Deque *d, struct Task task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->capacity && d->head > 0) {
+        memmove(d->tasks, d->tasks + d->head,
+        (d->tail - d->head) * sizeof(struct Task));
+        d->tail -= d->head;
+        d->head = 0;
+    }
+    if (d->tail == d->capacity) {
+        size_t capacity = d->capacity ? 2 * d->capacity : 64;
+        struct Task *grown = (struct Task *)realloc(d->tasks,
+        capacity * sizeof(struct Task));
+        if (!grown) {
+            pthread_mutex_unlock(&d->lock);
+            return -1;
+        }
+        d->tasks = grown;
+        d->capacity = capacity;
+    }
+    d->tasks[d->tail++] = task;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+// The owner takes the newest task, thieves the oldest
+static int deque_take(struct Deque *d, struct Task *task, int steal) {
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *task = steal ? d->tasks[d->head++] : d->tasks[--d->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static void finish_job(struct Batch *b, struct BatchJob *job) {
+    close(job->in_fd);
+    if (close(job->out_fd) != 0) {
+        atomic_store(&job->failed, 1);
+    }
+    if (atomic_load(&job->failed)) {
+        fprintf(stderr, "Batch: %s -> %s failed\n", job->job.input_file,
+        job->job.output_file);
+        atomic_fetch_add(&b->failed, 1);
+    }
+    atomic_fetch_add(&b->done, 1);
+}
+
+// Open the files, write the header and queue the range tasks
+static void start_job(struct Batch *b, int w, struct BatchJob *job) {
+    struct Context *ctx = b->ctx;
+    unsigned char head[HEADER_SIZE];
+    errno = 0;
+    job->in_fd = open(job->job.input_file, O_RDONLY | O_CLOEXEC);
+    // The output is truncated before the input is read
+    int same = same_file(job->job.input_file, job->job.output_file);
+    job->out_fd = job->in_fd < 0 || same ? -1 : open(job->job.output_file,
+    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = job->out_fd >= 0
+    && pread_full(job->in_fd, head, HEADER_SIZE, 0) == 0
+    && parse_header(head, &job->video) == 0;
+    if (ok) {
+        job->reversed = check_stages(job->job.ops, job->job.count,
+        &job->video);
+        ok = job->reversed >= 0;
+    }
+    size_t frame_size = job->video.channels * job->video.height
+    * job->video.width;
+    ok = ok && pwrite_full(job->out_fd, head, HEADER_SIZE, 0) == 0
+    && ftruncate(job->out_fd, HEADER_SIZE + job->video.frames
+    * frame_size) == 0;
+    if (!ok) {
+        fprintf(stderr, "Batch: cannot start %s: %s\n", job->job.input_file,
+        same ? "input and output are the same file" : errno ? strerror(errno)
+        : "invalid video or operation");
+        if (job->in_fd >= 0) {
+            close(job->in_fd);
+        }
+        if (job->out_fd >= 0) {
+            close(job->out_fd);
+        }
+        atomic_fetch_add(&b->failed, 1);
+        atomic_fetch_add(&b->done, 1);
+        return;
+    }
+    metrics_count(ctx, HEADER_SIZE, HEADER_SIZE, 0);
+
+    int64_t range = frame_size > 0 ? RANGE_BYTES / frame_size : 1;
+    job->range = range < 1 ? 1 : (range > IOV_MAX ? IOV_MAX : range);
+    // A video of empty frames is just its header
+    int64_t ranges = frame_size > 0
+    ? (job->video.frames + job->range - 1) / job->range : 0;
+    if (ranges == 0) {
+        finish_job(b, job);
+        return;
+    }
+    atomic_store(&job->left, ranges);
+    atomic_fetch_add(&b->pending, ranges);
+    // Pushed back to front, so the owner starts at the first range
+    for (int64_t r = ranges - 1; r >= 0; --r) {
+        struct Task task = {job, r * job->range};
+        if (deque_push(&b->deques[w], task) != 0) {
+            fprintf(stderr, "Memory allocation failed for task queue!\n");
+            atomic_store(&job->failed, 1);
+            atomic_fetch_sub(&b->pending, r + 1);
+            if (atomic_fetch_sub(&job->left, r + 1) == r + 1) {
+                finish_job(b, job);
+            }
+            return;
+        }
+    }
+}
+
+// pread one range, run the stages, pwrite it at its output offset
+static void run_range(struct Batch *b, int w, struct BatchJob *job,
+                      int64_t first) {
+    struct Context *ctx = b->ctx;
+    size_t channel_size = job->video.height * job->video.width;
+    size_t frame_size = job->video.channels * channel_size;
+    int64_t frames = job->video.frames;
+    int64_t n = frames - first < job->range ? frames - first : job->range;
+    size_t bytes = n * frame_size;
+    unsigned char *buffer = pool_scratch(ctx, w, SCRATCH_RING,
+    job->range * frame_size);
+    unsigned char *temp_channel = pool_scratch(ctx, w, SCRATCH_CHANNEL,
+    channel_size);
+
+    int failed = atomic_load(&job->failed) || !buffer || !temp_channel;
+    double start = metrics_begin(ctx);
+    failed = failed || pread_full(job->in_fd, buffer, bytes,
+    HEADER_SIZE + first * frame_size) != 0;
+    metrics_end(ctx, STAGE_READ, start);
+    if (!failed) {
+        start = metrics_begin(ctx);
+        for (int64_t k = 0; k < n; ++k) {
+            apply_stages(buffer + k * frame_size, job->job.ops,
+            job->job.count, channel_size, temp_channel);
+        }
+        metrics_end(ctx, STAGE_COMPUTE, start);
+        start = metrics_begin(ctx);
+        if (job->reversed) {
+            struct iovec iov[IOV_MAX];
+            for (int64_t k = 0; k < n; ++k) {
+                iov[k].iov_base = buffer + (n - 1 - k) * frame_size;
+                iov[k].iov_len = frame_size;
+            }
+            off_t offset = HEADER_SIZE + (frames - first - n) * frame_size;
+            // Ranges of one job share the descriptor, so no lseek
+            failed = pwritev_full(job->out_fd, iov, (int)n, offset) != 0;
+        } else {
+            failed = pwrite_full(job->out_fd, buffer, bytes,
+            HEADER_SIZE + first * frame_size) != 0;
+        }
+        metrics_end(ctx, STAGE_WRITE, start);
+        metrics_count(ctx, bytes, bytes, n);
+    }
+    if (failed) {
+        atomic_store(&job->failed, 1);
+    }
+    if (atomic_fetch_sub(&job->left, 1) == 1) {
+        finish_job(b, job);
+    }
+}
+
+static int next_task(struct Batch *b, int w, struct Task *task) {
+    for (;;) {
+        if (deque_take(&b->deques[w], task, 0)) {
+            return 1;
+        }
+        for (int i = 1; i < b->workers; ++i) {
+            if (deque_take(&b->deques[(w + i) % b->workers], task, 1)) {
+                return 1;
+            }
+        }
+        int j = atomic_fetch_add(&b->next_job, 1);
+        if (j < b->count) {
+            atomic_fetch_add(&b->pending, 1);
+            task->job = &b->jobs[j];
+            task->first = -1;
+            return 1;
+        }
+        // Another worker may still be about to queue ranges
+        if (atomic_load(&b->pending) == 0) {
+            return 0;
+        }
+        sched_yield();
+    }
+}
+
+struct WorkerArg {
+    struct Batch *batch;
+    int index;
+};
+
+static void *batch_worker(void *arg) {
+    struct WorkerArg *a = arg;
+    struct Batch *b = a->batch;
+    struct Task task;
+    while (next_task(b, a->index, &task)) {
+        if (task.first < 0) {
+            start_job(b, a->index, task.job);
+        } else {
+            run_range(b, a->index, task.job, task.first);
+        }
+        atomic_fetch_sub(&b->pending, 1);
+    }
+    return NULL;
+}
+
+// Every job runs on the batch engine's own pread/pwrite tasks, so a line
+// may not ask for a mode or an option that only the single-job backends
+// honour. Returns the first such option, NULL if there is none
+static const char *unsupported_option(const struct Job *job) {
+    const struct Settings *s = &job->settings;
+    const struct {
+        int set;
+        const char *name;
+    } options[] = {
+        {job->mode == 1, "-S"}, {job->mode == 0, "-M"},
+        {s->use_mmap, "--mmap"}, {s->populate, "--populate"},
+        {s->copy_range, "--copy-range"}, {s->in_place, "--in-place"},
+        {s->mem_limit > 0, "--mem-limit"}, {s->batch_frames > 0, "--batch"},
+        {s->uring_depth > 0, "--uring"}, {s->direct, "--direct"},
+        {s->first_frame > 0 || s->last_frame > 0, "--frames"},
+        {s->compress, "--compress"}, {s->view, "--view"},
+        {s->cache_dir != NULL, "--cache"},
+        {s->cache_limit > 0, "--cache-limit"},
+        {s->cache_fast, "--cache-fast"}, {job->auto_plan, "--auto"},
+        {s->metrics, "--metrics"},
+    };
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); ++i) {
+        if (options[i].set) {
+            return options[i].name;
+        }
+    }
+    return NULL;
+}
+
+// Parse one job from argument strings and add it to the batch; line is
+// the job's storage and is owned by the batch once the job is added
+static int add_job(struct Batch *b, int *capacity, int argc, char **argv,
+                   char *line, int number) {
+    if (b->count == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 64;
+        struct BatchJob *grown = (struct BatchJob *)realloc(b->jobs,
+        *capacity * sizeof(struct BatchJob));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed for batch jobs!\n");
+            return -1;
+        }
+        b->jobs = grown;
+    }
+    struct BatchJob *job = &b->jobs[b->count];
+    memset(job, 0, sizeof(*job));
+    if (parse_job(argc, argv, &job->job) != 0) {
+        fprintf(stderr, "Batch: invalid job on line %d\n", number);
+        return -1;
+    }
+    const char *option = unsupported_option(&job->job);
+    if (option) {
+        fprintf(stderr, "Batch: line %d: %s is not supported in batch mode\n",
+        number, option);
+        return -1;
+    }
+    // The tasks read raw frames at fixed offsets
+    const char *input = job->job.input_file;
+    if (is_container(input) || is_view(input)) {
+        fprintf(stderr, "Batch: line %d: %s input %s is not supported in"
+        " batch mode\n", number, is_view(input) ? "view" : "compressed",
+        input);
+        return -1;
+    }
+    job->line = line;
+    b->count++;
+    return 0;
+}
+
+// One job per line: input output operations, split on
+// whitespace; blank lines and lines starting with # are skipped
+static int read_manifest(struct Batch *b, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Error opening manifest");
+        return -1;
+    }
+    char *text = NULL;
+    size_t size = 0;
+    int capacity = 0, number = 0, failed = 0;
+    while (!failed && getline(&text, &size, file) >= 0) {
+        number++;
+        char *line = strdup(text);
+        if (!line) {
+            fprintf(stderr, "Memory allocation failed for batch jobs!\n");
+            failed = 1;
+            break;
+        }
+        char *argv[MAX_OPS * 4 + 16];
+        int max_args = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
+        int argc = 1;
+        argv[0] = "runme";
+        char *save = NULL;
+        char *token = strtok_r(line, " \t\r\n", &save);
+        for (; token && argc < max_args;
+        token = strtok_r(NULL, " \t\r\n", &save)) {
+            argv[argc++] = token;
+        }
+        argv[argc] = NULL;
+        if (argc == 1 || argv[1][0] == '#') {
+            free(line);
+            continue;
+        }
+        // A longer line would lose its last arguments
+        if (token) {
+            fprintf(stderr, "Batch: line %d: more than %d arguments\n",
+            number, max_args - 1);
+            free(line);
+            failed = 1;
+            break;
+        }
+        if (add_job(b, &capacity, argc, argv, line, number) != 0) {
+            free(line);
+            failed = 1;
+        }
+    }
+    free(text);
+    fclose(file);
+    return failed ? -1 : 0;
+}
+
+// Every file matching DIR/PATTERN becomes OUTDIR/<name> with the same
+// options and operations
+static int read_directory(struct Batch *b, int argc, char *argv[]) {
+    char pattern[PATH_MAX];
+    snprintf(pattern, sizeof(pattern), "%s/%s", argv[2], argv[3]);
+    glob_t found;
+    int status = glob(pattern, 0, NULL, &found);
+    if (status == GLOB_NOMATCH) {
+        fprintf(stderr, "Batch: nothing matches %s\n", pattern);
+        return -1;
+    }
+    if (status != 0) {
+        perror("Error listing directory");
+        return -1;
+    }
+    int capacity = 0, failed = 0;
+    char **job_argv = (char **)malloc((argc - 2) * sizeof(char *));
+    for (size_t i = 0; job_argv && !failed && i < found.gl_pathc; ++i) {
+        const char *name = strrchr(found.gl_pathv[i], '/');
+        name = name ? name + 1 : found.gl_pathv[i];
+        size_t in_len = strlen(found.gl_pathv[i]) + 1;
+        size_t out_len = strlen(argv[4]) + strlen(name) + 2;
+        char *line = (char *)malloc(in_len + out_len);
+        if (!line) {
+            failed = 1;
+            break;
+        }
+        memcpy(line, found.gl_pathv[i], in_len);
+        snprintf(line + in_len, out_len, "%s/%s", argv[4], name);
+        job_argv[0] = "runme";
+        job_argv[1] = line;
+        job_argv[2] = line + in_len;
+        for (int k = 5; k < argc; ++k) {
+            job_argv[k - 2] = argv[k];
+        }
+        if (add_job(b, &capacity, argc - 2, job_argv, line, (int)i + 1)
+        != 0) {
+            free(line);
+            failed = 1;
+        }
+    }
+    if (!job_argv) {
+        fprintf(stderr, "Memory allocation failed for batch jobs!\n");
+        failed = 1;
+    }
+    free(job_argv);
+    globfree(&found);
+    return failed ? -1 : 0;
+}
+
+// ./runme --manifest FILE [--workers=N]
+// ./runme --dir DIR PATTERN OUTDIR [--workers=N] ops...
+int batch_main(int argc, char *argv[]) {
+    int directory = strcmp(argv[1], "--dir") == 0;
+    int fixed = directory ? 5 : 3;
+    int workers = omp_get_num_procs();
+    if (argc > fixed && strncmp(argv[fixed], "--workers=", 10) == 0) {
+        workers = atoi(argv[fixed] + 10);
+        // Drop the option so the rest is a plain job command line
+        memmove(&argv[fixed], &argv[fixed + 1],
+        (argc - fixed) * sizeof(char *));
+        argc--;
+    }
+    if (argc < fixed || workers < 1 || (!directory && argc != fixed)) {
+        print_usage();
+        return 1;
+    }
+
+    struct Batch b;
+    memset(&b, 0, sizeof(b));
+    b.workers = workers;
+    int loaded = directory ? read_directory(&b, argc, argv)
+    : read_manifest(&b, argv[2]);
+    struct Settings settings = {0};
+    settings.metrics = 1;
+    b.ctx = loaded == 0 ? context_create(&settings, 1) : NULL;
+    b.deques = (struct Deque *)calloc(workers, sizeof(struct Deque));
+    pthread_t *threads = (pthread_t *)malloc(workers * sizeof(pthread_t));
+    struct WorkerArg *args = (struct WorkerArg *)malloc(workers
+    * sizeof(struct WorkerArg));
+    int started = 0;
+    double start = metrics_now();
+    if (b.ctx && b.deques && threads && args
+    && pool_reserve(b.ctx, workers) == 0) {
+        for (int i = 0; i < workers; ++i) {
+            pthread_mutex_init(&b.deques[i].lock, NULL);
+        }
+        while (started < workers) {
+            args[started].batch = &b;
+            args[started].index = started;
+            if (pthread_create(&threads[started], NULL, batch_worker,
+            &args[started]) != 0) {
+                break;
+            }
+            started++;
+        }
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    double wall = metrics_now() - start;
+
+    int result = 1;
+    if (started > 0) {
+        struct Metrics *m = &b.ctx->metrics;
+        double mb = (atomic_load(&m->bytes_read)
+        + atomic_load(&m->bytes_written)) / (1024.0 * 1024.0);
+        uint64_t frames = atomic_load(&m->frames);
+        printf("Batch: %d jobs, %d failed, %d workers, %.3f s\n", b.count,
+        atomic_load(&b.failed), started, wall);
+        printf("Throughput: %.1f jobs/s, %.0f frames/s, %.1f MB/s"
+        " (read + written)\n", wall > 0 ? b.count / wall : 0,
+        wall > 0 ? frames / wall : 0, wall > 0 ? mb / wall : 0);
+        printf("Scratch pool high-water: %zu KB\n",
+        pool_high_water(b.ctx) / 1024);
+        result = atomic_load(&b.failed) == 0 && atomic_load(&b.done)
+        == b.count ? 0 : 1;
+    } else if (loaded == 0) {
+        fprintf(stderr, "Error starting batch workers\n");
+    }
+
+    for (int i = 0; b.deques && i < started; ++i) {
+        free(b.deques[i].tasks);
+        pthread_mutex_destroy(&b.deques[i].lock);
+    }
+    for (int i = 0; i < b.count; ++i) {
+        free(b.jobs[i].line);
+    }
+    free(b.jobs);
+    free(b.deques);
+    free(threads);
+    free(args);
+    context_destroy(b.ctx);
+    return result;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// Per-stage instrumentation. Stages are timed around whole calls (one
+// fread, one frame loop), never per pixel, and when metrics are off every
+// hook is a single branch. Times are busy seconds summed over threads, so
+// in the overlapped modes they can add up to more than the wall time.
+
+static const char *stage_names[STAGE_COUNT] = {
+    "header", "alloc", "read", "compute", "write"
+};
+
+double metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void metrics_reset(struct Context *ctx) {
+    struct Metrics *m = &ctx->metrics;
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        atomic_store(&m->nanos[s], 0);
+    }
+    atomic_store(&m->bytes_read, 0);
+    atomic_store(&m->bytes_written, 0);
+    atomic_store(&m->frames, 0);
+    atomic_store(&m->cache_hits, 0);
+    atomic_store(&m->cache_misses, 0);
+    atomic_store(&m->cache_hash_bytes, 0);
+    atomic_store(&m->cache_hash_nanos, 0);
+}
+
+double metrics_begin(struct Context *ctx) {
+    return ctx->metrics.enabled ? metrics_now() : 0.0;
+}
+
+void metrics_end(struct Context *ctx, enum MetricStage stage, double start) {
+    if (!ctx->metrics.enabled) {
+        return;
+    }
+    uint64_t nanos = (uint64_t)((metrics_now() - start) * 1e9);
+    atomic_fetch_add_explicit(&ctx->metrics.nanos[stage], nanos,
+    memory_order_relaxed);
+}
+
+void metrics_count(struct Context *ctx, uint64_t bytes_read,
+                   uint64_t bytes_written, uint64_t frames) {
+    if (!ctx->metrics.enabled) {
+        return;
+    }
+    atomic_fetch_add_explicit(&ctx->metrics.bytes_read, bytes_read,
+    memory_order_relaxed);
+    atomic_fetch_add_explicit(&ctx->metrics.bytes_written, bytes_written,
+    memory_order_relaxed);
+    atomic_fetch_add_explicit(&ctx->metrics.frames, frames,
+    memory_order_relaxed);
+}
+
+void metrics_cache(struct Context *ctx, int hit) {
+    if (!ctx->metrics.enabled) {
+        return;
+    }
+    atomic_fetch_add_explicit(hit ? &ctx->metrics.cache_hits
+    : &ctx->metrics.cache_misses, 1, memory_order_relaxed);
+}
+
+// Hashing for the cache key is overhead of --cache, not part of the job,
+// so it stays out of the read stage and the byte counts
+void metrics_cache_hash(struct Context *ctx, uint64_t bytes, double start) {
+    if (!ctx->metrics.enabled) {
+        return;
+    }
+    uint64_t nanos = (uint64_t)((metrics_now() - start) * 1e9);
+    atomic_fetch_add_explicit(&ctx->metrics.cache_hash_nanos, nanos,
+    memory_order_relaxed);
+    atomic_fetch_add_explicit(&ctx->metrics.cache_hash_bytes, bytes,
+    memory_order_relaxed);
+}
+
+size_t metered_fread(struct Context *ctx, void *buf, size_t size, size_t n,
+                     FILE *input) {
+    double start = metrics_begin(ctx);
+    size_t done = fread(buf, size, n, input);
+    metrics_end(ctx, STAGE_READ, start);
+    metrics_count(ctx, done * size, 0, 0);
+    return done;
+}
+
+size_t metered_fwrite(struct Context *ctx, const void *buf, size_t size,
+                      size_t n, FILE *output) {
+    double start = metrics_begin(ctx);
+    size_t done = fwrite(buf, size, n, output);
+    metrics_end(ctx, STAGE_WRITE, start);
+    metrics_count(ctx, 0, done * size, 0);
+    return done;
+}
+
+void *metered_malloc(struct Context *ctx, size_t size) {
+    double start = metrics_begin(ctx);
+    void *p = malloc(size);
+    metrics_end(ctx, STAGE_ALLOC, start);
+    return p;
+}
+
+// Write the report as one JSON object. The bound field compares the time
+// spent in I/O with the time spent computing.
+void metrics_report(struct Context *ctx, FILE *out, const char *operation,
+                    const char *mode, double wall_seconds) {
+    struct Metrics *m = &ctx->metrics;
+    double seconds[STAGE_COUNT];
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        seconds[s] = atomic_load(&m->nanos[s]) / 1e9;
+    }
+    double io = seconds[STAGE_READ] + seconds[STAGE_WRITE];
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(out, "{\"operation\": \"%s\", \"mode\": \"%s\", \"wall_s\": %.6f,"
+    " \"stages\": {", operation, mode, wall_seconds);
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        fprintf(out, "%s\"%s_s\": %.6f", s ? ", " : "", stage_names[s],
+        seconds[s]);
+    }
+    fprintf(out, "}, \"bytes_read\": %lu, \"bytes_written\": %lu,"
+    " \"frames\": %lu, \"cache_hits\": %lu, \"cache_misses\": %lu,"
+    " \"cache_hash_bytes\": %lu, \"cache_hash_s\": %.6f,"
+    " \"max_rss_kb\": %ld, \"pool_high_water\": %zu,"
+    " \"simd\": \"%s\", \"bound\": \"%s\"}\n",
+    (unsigned long)atomic_load(&m->bytes_read),
+    (unsigned long)atomic_load(&m->bytes_written),
+    (unsigned long)atomic_load(&m->frames),
+    (unsigned long)atomic_load(&m->cache_hits),
+    (unsigned long)atomic_load(&m->cache_misses),
+    (unsigned long)atomic_load(&m->cache_hash_bytes),
+    atomic_load(&m->cache_hash_nanos) / 1e9, usage.ru_maxrss,
+    pool_high_water(ctx), simd_kernel_name(),
+    io >= seconds[STAGE_COMPUTE] ? "io" : "compute");
+}
@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+// Memory-mapped backend: the input is mapped read-only, the output is
+// preallocated and mapped writable, and frames go straight from one
+// mapping to the other without a stdio buffer or a full-file malloc.
+int mmap_process(struct Context *ctx, const char *input_file,
+                 const char *output_file, const struct Operation *ops,
+                 int count, int memory_free) {
+    struct Video header;
+    FILE *input = fopen(input_file, "rb");
+    if (!input) {
+        printf("Error opening input file.\n");
+        return -1;
+    }
+    int bad_header = read_headerdata(ctx, input, &header);
+    fclose(input);
+    if (bad_header) {
+        return -1;
+    }
+
+    int reversed = check_stages(ops, count, &header);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        return -1;
+    }
+
+    size_t frame_size = header.channels * header.height * header.width;
+    size_t channel_size = header.height * header.width;
+    size_t map_size = HEADER_SIZE + header.frames * frame_size;
+
+    int in_fd = open(input_file, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(in_fd, &st) != 0 || (size_t)st.st_size < map_size) {
+        fprintf(stderr, "Error: Input file is shorter than its header "
+        "claims\n");
+        close(in_fd);
+        return -1;
+    }
+
+    int out_fd = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Error opening output file");
+        close(in_fd);
+        return -1;
+    }
+    // Reserve the blocks up front so a full disk is reported here
+    // instead of as a SIGBUS while writing through the mapping. Only a
+    // filesystem that cannot preallocate falls back to a sparse file
+    int err = posix_fallocate(out_fd, 0, map_size);
+    if (err == EOPNOTSUPP || err == EINVAL) {
+        err = ftruncate(out_fd, map_size) != 0 ? errno : 0;
+    }
+    if (err != 0) {
+        fprintf(stderr, "Error sizing output file: %s\n", strerror(err));
+        close(in_fd);
+        close(out_fd);
+        return -1;
+    }
+
+    int flags = MAP_SHARED | (ctx->settings.populate ? MAP_POPULATE : 0);
+    unsigned char *in = mmap(NULL, map_size, PROT_READ, flags, in_fd, 0);
+    unsigned char *out = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+    flags, out_fd, 0);
+    close(in_fd);
+    close(out_fd);
+    if (in == MAP_FAILED || out == MAP_FAILED) {
+        perror("Error mapping video");
+        if (in != MAP_FAILED) {
+            munmap(in, map_size);
+        }
+        if (out != MAP_FAILED) {
+            munmap(out, map_size);
+        }
+        return -1;
+    }
+
+    // Reversed input is walked back to front, so the kernel's forward
+    // read-ahead would only waste I/O there
+    madvise(in, map_size, (reversed ? MADV_RANDOM : MADV_SEQUENTIAL));
+    madvise(in, map_size, MADV_WILLNEED);
+    madvise(out, map_size, MADV_SEQUENTIAL);
+
+    memcpy(out, in, HEADER_SIZE);
+    const unsigned char *src = in + HEADER_SIZE;
+    unsigned char *dst = out + HEADER_SIZE;
+    int64_t frames = header.frames;
+
+    // Page faults on both mappings happen inside the frame loop,
+    // so its time is reported as compute
+    int failed = pool_reserve(ctx, omp_get_max_threads()) != 0;
+    double start = metrics_begin(ctx);
+    if (memory_free == 1) {
+        #pragma omp parallel reduction(|:failed)
+        {
+            unsigned char *temp_channel = pool_scratch(ctx,
+            omp_get_thread_num(), SCRATCH_CHANNEL, channel_size);
+            failed = !temp_channel;
+            #pragma omp for
+            for (int64_t f = 0; f < frames; ++f) {
+                if (!temp_channel) {
+                    continue;
+                }
+                int64_t from = reversed ? frames - 1 - f : f;
+                unsigned char *frame = dst + f * frame_size;
+                memcpy(frame, src + from * frame_size, frame_size);
+                apply_stages(frame, ops, count, channel_size, temp_channel);
+            }
+        }
+    } else {
+        unsigned char *temp_channel = pool_scratch(ctx, 0,
+        SCRATCH_CHANNEL, channel_size);
+        failed = failed || !temp_channel;
+        for (int64_t f = 0; f < frames && !failed; ++f) {
+            int64_t from = reversed ? frames - 1 - f : f;
+            unsigned char *frame = dst + f * frame_size;
+            memcpy(frame, src + from * frame_size, frame_size);
+            apply_stages(frame, ops, count, channel_size, temp_channel);
+        }
+    }
+
+    metrics_end(ctx, STAGE_COMPUTE, start);
+    metrics_count(ctx, map_size, map_size, frames);
+
+    munmap(in, map_size);
+    munmap(out, map_size);
+    if (failed) {
+        printf("Memory allocation failed for temp_channel!\n");
+        return -1;
+    }
+    printf("Video processed through mmap and saved to %s\n", output_file);
+    return 0;
+}
@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <omp.h>
+
+// Positional I/O helpers: unlike stdio they keep no file position, so
+// several threads can work on disjoint ranges of the same descriptor.
+
+int pread_full(int fd, void *buf, size_t len, off_t offset) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+int pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Copy len bytes between two files inside the kernel. Falls back to
+// pread/pwrite through the bounce buffer when copy_file_range is not
+// supported for this pair of files; *kernel_copy records that so later
+// calls skip the failing syscall.
+int copy_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset,
+               size_t len, unsigned char *bounce, size_t bounce_size,
+               int *kernel_copy) {
+    while (len > 0 && *kernel_copy) {
+        loff_t in_off = in_offset;
+        loff_t out_off = out_offset;
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS
+            && errno != EOPNOTSUPP && errno != EBADF) {
+                return -1;
+            }
+            *kernel_copy = 0;
+            break;
+        }
+        in_offset += n;
+        out_offset += n;
+        len -= n;
+    }
+    while (len > 0) {
+        size_t chunk = len < bounce_size ? len : bounce_size;
+        if (pread_full(in_fd, bounce, chunk, in_offset) != 0
+        || pwrite_full(out_fd, bounce, chunk, out_offset) != 0) {
+            return -1;
+        }
+        in_offset += chunk;
+        out_offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Reverse by pure data movement: input frame i is copied by the kernel to
+// output frame N-1-i, with the frames split between the OpenMP threads.
+// On filesystems with reflinks or server-side copy no data passes
+// through user space at all.
+int reverse_copy_range(struct Context *ctx, const char *input_file,
+                       const char *output_file) {
+    struct Video header;
+    FILE *input = fopen(input_file, "rb");
+    if (!input) {
+        perror("Error opening input file");
+        return -1;
+    }
+    int bad_header = read_headerdata(ctx, input, &header);
+    fclose(input);
+    if (bad_header) {
+        return -1;
+    }
+
+    size_t frame_size = header.channels * header.height * header.width;
+    off_t total_size = HEADER_SIZE + header.frames * frame_size;
+
+    int in_fd = open(input_file, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    int out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Error opening output file");
+        close(in_fd);
+        return -1;
+    }
+
+    unsigned char head[HEADER_SIZE];
+    if (pread_full(in_fd, head, HEADER_SIZE, 0) != 0
+    || pwrite_full(out_fd, head, HEADER_SIZE, 0) != 0
+    || ftruncate(out_fd, total_size) != 0) {
+        perror("Error writing output header");
+        close(in_fd);
+        close(out_fd);
+        return -1;
+    }
+
+    // Shared, so the first failed copy stops every thread's remaining
+    // frames
+    atomic_int failed = pool_reserve(ctx, omp_get_max_threads()) != 0;
+    #pragma omp parallel
+    {
+        unsigned char *bounce = pool_scratch(ctx,
+        omp_get_thread_num(), SCRATCH_FRAME, frame_size);
+        int kernel_copy = 1;
+        #pragma omp for schedule(static)
+        for (int64_t i = 0; i < header.frames; ++i) {
+            if (atomic_load_explicit(&failed, memory_order_relaxed)
+            || !bounce) {
+                atomic_store(&failed, 1);
+                continue;
+            }
+            double start = metrics_begin(ctx);
+            if (copy_range(in_fd, HEADER_SIZE + i * frame_size, out_fd,
+            HEADER_SIZE + (header.frames - 1 - i) * frame_size, frame_size,
+            bounce, frame_size, &kernel_copy) != 0) {
+                fprintf(stderr, "Error copying frame %ld\n", i);
+                atomic_store(&failed, 1);
+            }
+            metrics_end(ctx, STAGE_WRITE, start);
+            metrics_count(ctx, frame_size, frame_size, 1);
+        }
+    }
+
+    close(in_fd);
+    close(out_fd);
+    if (failed) {
+        return -1;
+    }
+    printf("Video frames reversed and saved to %s\n", output_file);
+    return 0;
+}
+
+// Write the iovecs at offset, continuing after partial writes
+int pwritev_full(int fd, struct iovec *iov, int count, off_t offset) {
+    for (;;) {
+        // pwritev returns 0 for empty buffers, which is not a short write
+        while (count > 0 && iov->iov_len == 0) {
+            iov++;
+            count--;
+        }
+        if (count == 0) {
+            return 0;
+        }
+        ssize_t n = pwritev(fd, iov, count, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        offset += n;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Compose the plane order of a chain that only reverses, swaps and
+// permutes, so output plane k is input plane order[k]. Returns 0 if any
+// stage edits pixels.
+static int plane_order(const struct Operation *ops, int count,
+                       int channels, unsigned char *order) {
+    for (int c = 0; c < channels; ++c) {
+        order[c] = (unsigned char)c;
+    }
+    for (int i = 0; i < count; ++i) {
+        unsigned char perm[MAX_CH], composed[MAX_CH];
+        if (ops[i].type == OP_REVERSE) {
+            continue;
+        }
+        if ((ops[i].type != OP_SWAP && ops[i].type != OP_PERMUTE)
+        || stage_permutation(&ops[i], channels, perm) != 0) {
+            return 0;
+        }
+        for (int c = 0; c < channels; ++c) {
+            composed[c] = order[perm[c]];
+        }
+        memcpy(order, composed, channels);
+    }
+    return 1;
+}
+
+// -S, and -M reverse, with parallel I/O: the frames are split into
+// frame-aligned ranges and every thread of the team loads a range with
+// pread, runs the stages on it and stores it with pwrite before taking
+// the next one. Loads, compute and stores of different ranges overlap,
+// and each thread only holds its own range. A reversed range is stored
+// back to front with one gather write at its mirrored offset, so no
+// frame is copied inside the buffer. A chain of reverses, swaps and
+// permutations has no compute pass: the gather write points at the
+// planes in their new order.
+int parallel_process(struct Context *ctx, const char *input_file,
+                     const char *output_file, const struct Operation *ops,
+                     int count) {
+    int in_fd = open(input_file, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    struct Video video;
+    unsigned char head[HEADER_SIZE];
+    double start = metrics_begin(ctx);
+    if (pread_full(in_fd, head, HEADER_SIZE, 0) != 0) {
+        fprintf(stderr, "Error: Failed to read video header\n");
+        close(in_fd);
+        return -1;
+    }
+    if (parse_header(head, &video) != 0) {
+        close(in_fd);
+        return -1;
+    }
+    metrics_end(ctx, STAGE_HEADER, start);
+    metrics_count(ctx, HEADER_SIZE, 0, 0);
+    int reversed = check_stages(ops, count, &video);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        close(in_fd);
+        return -1;
+    }
+
+    size_t channel_size = video.height * video.width;
+    size_t frame_size = video.channels * channel_size;
+    off_t total_size = HEADER_SIZE + video.frames * frame_size;
+    int out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Error opening output file");
+        close(in_fd);
+        return -1;
+    }
+    // Reserve the blocks up front so concurrent stores do not fragment
+    // the file; filesystems without fallocate just grow it as usual. A
+    // video of empty frames is just its header
+    if (frame_size > 0 && fallocate(out_fd, 0, 0, total_size) != 0
+    && errno != EOPNOTSUPP && errno != ENOSYS) {
+        perror("Error preallocating output file");
+        close(in_fd);
+        close(out_fd);
+        return -1;
+    }
+    if (pwrite_full(out_fd, head, HEADER_SIZE, 0) != 0) {
+        perror("Error writing output header");
+        close(in_fd);
+        close(out_fd);
+        return -1;
+    }
+    metrics_count(ctx, 0, HEADER_SIZE, 0);
+
+    // About PIO_RANGE_BYTES per range, with at least four ranges per
+    // thread so the team stays busy on short videos
+    int threads = omp_get_max_threads();
+    int64_t range = frame_size > 0 ? PIO_RANGE_BYTES / frame_size : 1;
+    int64_t spread = (video.frames + 4 * threads - 1) / (4 * threads);
+    if (range > spread) {
+        range = spread;
+    }
+    unsigned char order[MAX_CH];
+    int planes_only = plane_order(ops, count, video.channels, order);
+    int iov_frame = planes_only ? video.channels : 1;
+    if (iov_frame > 0 && range > IOV_MAX / iov_frame) {
+        range = IOV_MAX / iov_frame;
+    }
+    if (range < 1) {
+        range = 1;
+    }
+    int64_t ranges = frame_size > 0 ? (video.frames + range - 1) / range
+    : 0;
+
+    int failed = pool_reserve(ctx, threads) != 0;
+    #pragma omp parallel reduction(|:failed)
+    {
+        int t = omp_get_thread_num();
+        unsigned char *buffer = pool_scratch(ctx, t, SCRATCH_RING,
+        range * frame_size);
+        unsigned char *temp_channel = pool_scratch(ctx, t, SCRATCH_CHANNEL,
+        channel_size);
+        struct iovec iov[IOV_MAX];
+        #pragma omp for schedule(dynamic)
+        for (int64_t r = 0; r < ranges; ++r) {
+            if (failed || !buffer || !temp_channel) {
+                failed = 1;
+                continue;
+            }
+            int64_t first = r * range;
+            int64_t n = video.frames - first < range ? video.frames - first
+            : range;
+            size_t bytes = n * frame_size;
+            double phase = metrics_begin(ctx);
+            if (pread_full(in_fd, buffer, bytes,
+            HEADER_SIZE + first * frame_size) != 0) {
+                fprintf(stderr, "Error reading frames %ld to %ld\n", first,
+                first + n - 1);
+                failed = 1;
+                continue;
+            }
+            metrics_end(ctx, STAGE_READ, phase);
+
+            if (!planes_only) {
+                phase = metrics_begin(ctx);
+                for (int64_t k = 0; k < n; ++k) {
+                    apply_stages(buffer + k * frame_size, ops, count,
+                    channel_size, temp_channel);
+                }
+                metrics_end(ctx, STAGE_COMPUTE, phase);
+            }
+
+            phase = metrics_begin(ctx);
+            off_t offset = HEADER_SIZE + (reversed
+            ? video.frames - first - n : first) * frame_size;
+            int stored;
+            if (planes_only) {
+                int v = 0;
+                for (int64_t k = 0; k < n; ++k) {
+                    unsigned char *frame = buffer
+                    + (reversed ? n - 1 - k : k) * frame_size;
+                    for (int c = 0; c < video.channels; ++c) {
+                        iov[v].iov_base = frame + order[c] * channel_size;
+                        iov[v++].iov_len = channel_size;
+                    }
+                }
+                stored = pwritev_full(out_fd, iov, v, offset);
+            } else if (reversed) {
+                for (int64_t k = 0; k < n; ++k) {
+                    iov[k].iov_base = buffer + (n - 1 - k) * frame_size;
+                    iov[k].iov_len = frame_size;
+                }
+                stored = pwritev_full(out_fd, iov, (int)n, offset);
+            } else {
+                stored = pwrite_full(out_fd, buffer, bytes, offset);
+            }
+            metrics_end(ctx, STAGE_WRITE, phase);
+            if (stored != 0) {
+                fprintf(stderr, "Error writing frames %ld to %ld\n", first,
+                first + n - 1);
+                failed = 1;
+                continue;
+            }
+            metrics_count(ctx, bytes, bytes, n);
+        }
+    }
+
+    close(in_fd);
+    if (close(out_fd) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        return -1;
+    }
+    printf("Video processed with parallel I/O and saved to %s\n",
+    output_file);
+    return 0;
+}
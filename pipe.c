@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <omp.h>
+
+// Streaming for "-" paths, so runme can sit between a decoder and an
+// encoder. Frames go through in blocks read and written sequentially.
+// Clip and scale between pipes splice the planes they do not touch
+// straight from input to output. Reverse needs the last frame first:
+// a seekable input is read block by block from the tail, anything else
+// is spilled to an unlinked temp file one block at a time and replayed
+// backward, so memory stays at one block.
+
+// Bytes per block when --mem-limit does not say otherwise
+#define PIPE_BLOCK_BYTES (8 << 20)
+
+int is_stdio_path(const char *path) {
+    return strcmp(path, "-") == 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Move len bytes from in to out, by splice while *use_splice is set and
+// through bounce otherwise. A pair of descriptors splice refuses clears
+// *use_splice before anything has moved.
+static int pass_through(int in, int out, size_t len, unsigned char *bounce,
+                        int *use_splice) {
+    while (len > 0 && *use_splice) {
+        ssize_t n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            *use_splice = 0;
+            break;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    if (len > 0 && (read_full(in, bounce, len) != 0
+    || write_full(out, bounce, len) != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Clip/scale only: edit the touched planes and pass the others through
+static int stream_planes(struct Context *ctx, int in, int out,
+                         const struct Video *video,
+                         const struct Operation *ops, int count,
+                         const int *touched, unsigned char *plane) {
+    size_t channel_size = video->height * video->width;
+    int use_splice = 1;
+    for (int64_t f = 0; f < video->frames; ++f) {
+        for (int c = 0; c < video->channels; ++c) {
+            double start = metrics_begin(ctx);
+            if (!touched[c]) {
+                if (pass_through(in, out, channel_size, plane, &use_splice)
+                != 0) {
+                    fprintf(stderr, "Error passing frame %ld through\n", f);
+                    return -1;
+                }
+                metrics_end(ctx, STAGE_WRITE, start);
+                continue;
+            }
+            if (read_full(in, plane, channel_size) != 0) {
+                fprintf(stderr, "Error reading frame %ld\n", f);
+                return -1;
+            }
+            metrics_end(ctx, STAGE_READ, start);
+            start = metrics_begin(ctx);
+            edit_plane(plane, channel_size, ops, count, c);
+            metrics_end(ctx, STAGE_COMPUTE, start);
+            start = metrics_begin(ctx);
+            if (write_full(out, plane, channel_size) != 0) {
+                fprintf(stderr, "Error writing frame %ld\n", f);
+                return -1;
+            }
+            metrics_end(ctx, STAGE_WRITE, start);
+        }
+        metrics_count(ctx, video->channels * channel_size,
+        video->channels * channel_size, 1);
+    }
+    return 0;
+}
+
+// Apply the stages to n frames and write them, back to front if asked
+static int emit_block(struct Context *ctx, int out, unsigned char *block,
+                      int64_t n, size_t frame_size, size_t channel_size,
+                      const struct Operation *ops, int count, int reversed,
+                      int memory_free) {
+    int failed = 0;
+    double start = metrics_begin(ctx);
+    #pragma omp parallel if (memory_free == 1) reduction(|:failed)
+    {
+        unsigned char *temp_channel = pool_scratch(ctx,
+        omp_get_thread_num(), SCRATCH_CHANNEL, channel_size);
+        failed = !temp_channel;
+        #pragma omp for
+        for (int64_t f = 0; f < n; ++f) {
+            if (temp_channel) {
+                apply_stages(block + f * frame_size, ops, count,
+                channel_size, temp_channel);
+            }
+        }
+    }
+    metrics_end(ctx, STAGE_COMPUTE, start);
+    if (failed) {
+        fprintf(stderr, "Memory allocation failed for temp channel!\n");
+        return -1;
+    }
+
+    start = metrics_begin(ctx);
+    if (reversed) {
+        struct iovec iov[IOV_MAX];
+        for (int64_t k = 0; k < n; ++k) {
+            iov[k].iov_base = block + (n - 1 - k) * frame_size;
+            iov[k].iov_len = frame_size;
+        }
+        failed = writev_all(out, iov, (int)n) != 0;
+    } else {
+        failed = write_full(out, block, n * frame_size) != 0;
+    }
+    metrics_end(ctx, STAGE_WRITE, start);
+    metrics_count(ctx, 0, n * frame_size, n);
+    if (failed) {
+        perror("Error writing frames");
+    }
+    return failed ? -1 : 0;
+}
+
+// Create an unlinked file for spilled blocks in $TMPDIR or /tmp
+static int open_spill(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/filmmaster-spill-XXXXXX",
+    dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+}
+
+// Reversed stream: emit the blocks from the last one back. A seekable
+// input is read in place; otherwise every block but the last is first
+// copied to the spill file.
+static int stream_reversed(struct Context *ctx, int in, int out,
+                           const struct Video *video,
+                           const struct Operation *ops, int count,
+                           unsigned char *block, int64_t k,
+                           int memory_free) {
+    size_t channel_size = video->height * video->width;
+    size_t frame_size = video->channels * channel_size;
+    int64_t blocks = (video->frames + k - 1) / k;
+    off_t base = lseek(in, 0, SEEK_CUR);
+    int store = in;
+    if (base < 0) {
+        store = open_spill();
+        base = 0;
+        if (store < 0) {
+            perror("Error creating spill file");
+            return -1;
+        }
+        for (int64_t b = 0; b + 1 < blocks; ++b) {
+            double start = metrics_begin(ctx);
+            if (read_full(in, block, k * frame_size) != 0) {
+                fprintf(stderr, "Error reading frames from %ld\n", b * k);
+                close(store);
+                return -1;
+            }
+            metrics_end(ctx, STAGE_READ, start);
+            metrics_count(ctx, k * frame_size, 0, 0);
+            if (pwrite_full(store, block, k * frame_size,
+            b * k * frame_size) != 0) {
+                perror("Error spilling frames");
+                close(store);
+                return -1;
+            }
+        }
+    }
+
+    int failed = 0;
+    for (int64_t b = blocks - 1; b >= 0 && !failed; --b) {
+        int64_t n = b == blocks - 1 ? video->frames - b * k : k;
+        double start = metrics_begin(ctx);
+        // The last block of a spilled stream is still in the pipe
+        if (store != in && b == blocks - 1) {
+            failed = read_full(in, block, n * frame_size) != 0;
+        } else {
+            failed = pread_full(store, block, n * frame_size,
+            base + b * k * frame_size) != 0;
+        }
+        metrics_end(ctx, STAGE_READ, start);
+        metrics_count(ctx, n * frame_size, 0, 0);
+        if (failed) {
+            fprintf(stderr, "Error reading frames from %ld\n", b * k);
+            break;
+        }
+        failed = emit_block(ctx, out, block, n, frame_size, channel_size,
+        ops, count, 1, memory_free) != 0;
+    }
+    if (store != in) {
+        close(store);
+    }
+    return failed ? -1 : 0;
+}
+
+int pipe_process(struct Context *ctx, const char *input_file,
+                 const char *output_file, const struct Operation *ops,
+                 int count, int memory_free) {
+    // A stream is read and written once, in order, so nothing that maps,
+    // seeks or rewrites a file applies to it
+    const struct Settings *settings = &ctx->settings;
+    const char *option = settings->in_place ? "--in-place"
+    : settings->use_mmap ? "--mmap" : settings->direct ? "--direct"
+    : settings->uring_depth > 0 ? "--uring"
+    : settings->copy_range ? "--copy-range" : NULL;
+    if (option) {
+        printf("Error: %s needs file paths, not -\n", option);
+        return -1;
+    }
+    int in = is_stdio_path(input_file) ? ctx->stdio_fds[0]
+    : open(input_file, O_RDONLY);
+    if (in < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    int out = is_stdio_path(output_file) ? ctx->stdio_fds[1]
+    : open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("Error opening output file");
+        if (!is_stdio_path(input_file)) {
+            close(in);
+        }
+        return -1;
+    }
+
+    struct Video video;
+    unsigned char head[HEADER_SIZE];
+    int failed = 0;
+    double start = metrics_begin(ctx);
+    if (read_full(in, head, HEADER_SIZE) != 0
+    || parse_header(head, &video) != 0) {
+        fprintf(stderr, "Error: Failed to read video header\n");
+        failed = 1;
+    }
+    metrics_end(ctx, STAGE_HEADER, start);
+    int reversed = failed ? 0 : check_stages(ops, count, &video);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        failed = 1;
+    }
+    if (!failed && write_full(out, head, HEADER_SIZE) != 0) {
+        perror("Error writing output header");
+        failed = 1;
+    }
+    metrics_count(ctx, HEADER_SIZE, HEADER_SIZE, 0);
+
+    size_t channel_size = video.height * video.width;
+    size_t frame_size = video.channels * channel_size;
+    int touched[MAX_CH] = {0};
+    int planes_only = 1;
+    // Channels are only trusted once check_stages has passed them
+    for (int i = 0; !failed && i < count; ++i) {
+        if (ops[i].type == OP_CLIP || ops[i].type == OP_SCALE) {
+            touched[ops[i].channel] = 1;
+        } else {
+            planes_only = 0;
+        }
+    }
+    // splice needs a pipe on one side
+    struct stat in_st, out_st;
+    int has_pipe = (fstat(in, &in_st) == 0 && S_ISFIFO(in_st.st_mode))
+    || (fstat(out, &out_st) == 0 && S_ISFIFO(out_st.st_mode));
+
+    size_t budget = ctx->settings.mem_limit > 0 ? ctx->settings.mem_limit
+    : PIPE_BLOCK_BYTES;
+    int64_t k = frame_size > 0 ? (int64_t)(budget / frame_size) : 1;
+    if (k < 1) {
+        k = 1;
+    }
+    if (k > IOV_MAX) {
+        k = IOV_MAX;
+    }
+    failed = failed || pool_reserve(ctx, omp_get_max_threads()) != 0;
+
+    if (!failed && planes_only && has_pipe) {
+        unsigned char *plane = pool_scratch(ctx, 0, SCRATCH_FRAME,
+        channel_size);
+        failed = !plane || stream_planes(ctx, in, out, &video, ops, count,
+        touched, plane) != 0;
+    } else if (!failed) {
+        unsigned char *block = pool_scratch(ctx, 0, SCRATCH_RING,
+        k * frame_size);
+        if (!block) {
+            fprintf(stderr, "Memory allocation failed for frame block!\n");
+            failed = 1;
+        } else if (reversed) {
+            failed = stream_reversed(ctx, in, out, &video, ops, count, block,
+            k, memory_free) != 0;
+        }
+        for (int64_t f = 0; !failed && !reversed && f < video.frames;
+        f += k) {
+            int64_t n = video.frames - f < k ? video.frames - f : k;
+            start = metrics_begin(ctx);
+            if (read_full(in, block, n * frame_size) != 0) {
+                fprintf(stderr, "Error reading frames from %ld\n", f);
+                failed = 1;
+                break;
+            }
+            metrics_end(ctx, STAGE_READ, start);
+            metrics_count(ctx, n * frame_size, 0, 0);
+            failed = emit_block(ctx, out, block, n, frame_size, channel_size,
+            ops, count, 0, memory_free) != 0;
+        }
+    }
+
+    if (!is_stdio_path(input_file)) {
+        close(in);
+    }
+    if (!is_stdio_path(output_file) && close(out) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        return -1;
+    }
+    // stdout may be the video itself, so the note goes to stderr
+    fprintf(stderr, "Video streamed to %s\n", is_stdio_path(output_file)
+    ? "stdout" : output_file);
+    return 0;
+}
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+// Mode planner for --auto: estimates serial, -S and -M from the header,
+// the machine and a small cost profile, and picks the cheapest one that
+// fits in memory. The profile is measured once by a micro-probe and kept
+// in a text file, see profile_path.
+
+#define PROBE_BYTES (8 << 20)
+#define PROBE_FRAME 4096
+#define PROBE_SEEKS 512
+
+struct Profile {  // Costs in nanoseconds
+    double read_ns;    // per byte through stdio
+    double write_ns;   // per byte through stdio
+    double copy_ns;    // per byte of memcpy
+    double clip_ns;    // per byte of clip_plane
+    double scale_ns;   // per byte of scale_plane
+    double frame_ns;   // per frame of seeking and ring hand-off in -M
+    double team_ns;    // per thread of starting a parallel region
+};
+
+static const struct {
+    const char *key;
+    size_t offset;
+} profile_keys[] = {
+    {"read_ns", offsetof(struct Profile, read_ns)},
+    {"write_ns", offsetof(struct Profile, write_ns)},
+    {"copy_ns", offsetof(struct Profile, copy_ns)},
+    {"clip_ns", offsetof(struct Profile, clip_ns)},
+    {"scale_ns", offsetof(struct Profile, scale_ns)},
+    {"frame_ns", offsetof(struct Profile, frame_ns)},
+    {"team_ns", offsetof(struct Profile, team_ns)},
+};
+#define PROFILE_FIELDS (int)(sizeof(profile_keys) / sizeof(profile_keys[0]))
+
+static double *profile_field(struct Profile *p, int i) {
+    return (double *)((char *)p + profile_keys[i].offset);
+}
+
+// $FM_PROFILE, else ~/.filmmaster2000_profile, else the working directory
+const char *profile_path(void) {
+    static _Thread_local char path[4096];
+    const char *env = getenv("FM_PROFILE");
+    if (env && *env) {
+        return env;
+    }
+    const char *home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s%s.filmmaster2000_profile",
+    home ? home : "", home ? "/" : "");
+    return path;
+}
+
+static int load_profile(const char *path, struct Profile *p) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    int found = 0;
+    char key[32];
+    double value;
+    while (fscanf(file, "%31s %lf", key, &value) == 2) {
+        for (int i = 0; i < PROFILE_FIELDS; ++i) {
+            if (strcmp(key, profile_keys[i].key) == 0) {
+                *profile_field(p, i) = value;
+                found |= 1 << i;
+            }
+        }
+    }
+    fclose(file);
+    return found == (1 << PROFILE_FIELDS) - 1 ? 0 : -1;
+}
+
+static double probe_seconds(double start) {
+    return metrics_now() - start;
+}
+
+// Measure the profile on this machine, takes well under a second
+static int measure_profile(struct Profile *p) {
+    unsigned char *buf = (unsigned char *)malloc(PROBE_BYTES);
+    unsigned char *copy = (unsigned char *)malloc(PROBE_BYTES);
+    FILE *file = tmpfile();
+    if (!buf || !copy || !file) {
+        free(buf);
+        free(copy);
+        if (file) {
+            fclose(file);
+        }
+        return -1;
+    }
+    for (size_t i = 0; i < PROBE_BYTES; ++i) {
+        buf[i] = (unsigned char)(i * 131);
+    }
+
+    double start = metrics_now();
+    memcpy(copy, buf, PROBE_BYTES);
+    p->copy_ns = probe_seconds(start) * 1e9 / PROBE_BYTES;
+    start = metrics_now();
+    clip_plane(copy, PROBE_BYTES, 10, 200);
+    p->clip_ns = probe_seconds(start) * 1e9 / PROBE_BYTES;
+    start = metrics_now();
+    scale_plane(copy, PROBE_BYTES, 1.5f);
+    p->scale_ns = probe_seconds(start) * 1e9 / PROBE_BYTES;
+
+    start = metrics_now();
+    fwrite(buf, 1, PROBE_BYTES, file);
+    fflush(file);
+    p->write_ns = probe_seconds(start) * 1e9 / PROBE_BYTES;
+    rewind(file);
+    start = metrics_now();
+    size_t got = fread(copy, 1, PROBE_BYTES, file);
+    p->read_ns = probe_seconds(start) * 1e9 / PROBE_BYTES;
+
+    start = metrics_now();
+    for (int i = 0; i < PROBE_SEEKS; ++i) {
+        long frame = (long)((i * 7919L) % (PROBE_BYTES / PROBE_FRAME));
+        fseek(file, frame * PROBE_FRAME, SEEK_SET);
+        got += fread(copy, 1, PROBE_FRAME, file);
+    }
+    p->frame_ns = probe_seconds(start) * 1e9 / PROBE_SEEKS
+    - PROBE_FRAME * p->read_ns;
+    if (p->frame_ns < 0) {
+        p->frame_ns = 0;
+    }
+    fclose(file);
+
+    int threads = omp_get_max_threads();
+    volatile int sink = 0;
+    start = metrics_now();
+    #pragma omp parallel reduction(+:sink)
+    {
+        sink += omp_get_thread_num() == 0;
+    }
+    p->team_ns = probe_seconds(start) * 1e9 / threads;
+
+    free(buf);
+    free(copy);
+    return got > 0 ? 0 : -1;
+}
+
+int calibrate_profile(const char *path) {
+    struct Profile p;
+    if (!path) {
+        path = profile_path();
+    }
+    if (measure_profile(&p) != 0) {
+        fprintf(stderr, "Error: Calibration probe failed\n");
+        return -1;
+    }
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Error writing profile");
+        return -1;
+    }
+    for (int i = 0; i < PROFILE_FIELDS; ++i) {
+        fprintf(file, "%s %.6f\n", profile_keys[i].key,
+        *profile_field(&p, i));
+    }
+    fclose(file);
+    return 0;
+}
+
+// Smallest of MemAvailable and the cgroup (v2 or v1) headroom, in bytes
+static double available_memory(void) {
+    double best = 0;
+    char line[256];
+    unsigned long long value;
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    if (meminfo) {
+        while (fgets(line, sizeof(line), meminfo)) {
+            if (sscanf(line, "MemAvailable: %llu kB", &value) == 1) {
+                best = value * 1024.0;
+            }
+        }
+        fclose(meminfo);
+    }
+    const char *limits[][2] = {
+        {"/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory.current"},
+        {"/sys/fs/cgroup/memory/memory.limit_in_bytes",
+        "/sys/fs/cgroup/memory/memory.usage_in_bytes"},
+    };
+    for (int i = 0; i < 2; ++i) {
+        unsigned long long limit, usage = 0;
+        FILE *file = fopen(limits[i][0], "r");
+        if (!file) {
+            continue;
+        }
+        int ok = fscanf(file, "%llu", &limit) == 1;  // "max" fails here
+        fclose(file);
+        file = fopen(limits[i][1], "r");
+        if (file) {
+            ok = ok && fscanf(file, "%llu", &usage) == 1;
+            fclose(file);
+        }
+        if (ok && limit > usage && (best == 0 || limit - usage < best)) {
+            best = (double)(limit - usage);
+        }
+    }
+    return best;
+}
+
+// CPUs in the affinity mask, reduced by a cgroup v2 CPU quota
+static int available_cores(void) {
+    cpu_set_t set;
+    int cores = sched_getaffinity(0, sizeof(set), &set) == 0
+    ? CPU_COUNT(&set) : omp_get_num_procs();
+    FILE *file = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (file) {
+        long quota, period;
+        if (fscanf(file, "%ld %ld", &quota, &period) == 2 && period > 0) {
+            int limit = (int)((quota + period - 1) / period);
+            if (limit >= 1 && limit < cores) {
+                cores = limit;
+            }
+        }
+        fclose(file);
+    }
+    return cores < 1 ? 1 : cores;
+}
+
+// Compute time of the stages per byte of video, on one thread
+static double compute_ns(const struct Profile *p, const struct Operation *ops,
+                         int count, int channels) {
+    double ns = 0;
+    for (int i = 0; i < count; ++i) {
+        if (ops[i].type == OP_REVERSE) {
+            ns += count == 1 ? p->copy_ns : 0;
+        } else if (ops[i].type == OP_SWAP || ops[i].type == OP_PERMUTE) {
+            ns += count == 1 ? 0 : 2 * p->copy_ns;
+        } else if (ops[i].type == OP_CLIP) {
+            ns += p->clip_ns / channels;
+        } else {
+            ns += p->scale_ns / channels;
+        }
+    }
+    return ns;
+}
+
+int plan_file(const char *input_file, const struct Operation *ops, int count,
+              struct Plan *plan) {
+    struct Video video;
+    unsigned char head[HEADER_SIZE];
+    FILE *input = fopen(input_file, "rb");
+    if (!input) {
+        perror("Error opening input file");
+        return -1;
+    }
+    size_t got = fread(head, 1, HEADER_SIZE, input);
+    fclose(input);
+    if (got != HEADER_SIZE || parse_header(head, &video) != 0) {
+        return -1;
+    }
+    // Frames without channels are just a header: nothing to model, and
+    // the per-channel costs would divide by zero
+    if (video.channels == 0) {
+        plan->memory_free = 2;
+        plan->threads = 1;
+        plan->seconds = 0;
+        for (int m = 0; m < 3; ++m) {
+            plan->estimates[m] = 0;
+        }
+        return 0;
+    }
+
+    const char *path = profile_path();
+    struct Profile p;
+    if (load_profile(path, &p) != 0) {
+        if (calibrate_profile(path) != 0 || load_profile(path, &p) != 0) {
+            return -1;
+        }
+    }
+
+    struct stat st;
+    double frame_size = (double)video.channels * video.height * video.width;
+    double bytes = video.frames * frame_size;
+    if (stat(input_file, &st) == 0 && st.st_size > bytes + HEADER_SIZE) {
+        bytes = st.st_size - HEADER_SIZE;
+    }
+    double compute = bytes * compute_ns(&p, ops, count, video.channels);
+    double read = bytes * p.read_ns;
+    double write = bytes * p.write_ns;
+    int cores = available_cores();
+
+    // Serial holds the whole video and -S one range of at least a frame
+    // per thread, each with 25% to spare; -M holds only its ring of frames
+    double memory = available_memory();
+    int serial_fits = memory == 0 || bytes * 1.25 < memory;
+    double range = frame_size > PIO_RANGE_BYTES ? frame_size
+    : PIO_RANGE_BYTES;
+    int s_cores = memory == 0 || memory / (range * 1.25) >= cores ? cores
+    : (int)(memory / (range * 1.25));
+
+    plan->estimates[2] = (read + compute + write) / 1e9;
+    plan->estimates[1] = -1;
+    plan->estimates[0] = -1;
+    plan->threads = 1;
+    int m_threads = 1;
+    for (int t = 1; t <= cores; ++t) {
+        double s = (read + compute / t + write + t * p.team_ns) / 1e9;
+        if (t <= s_cores && (plan->estimates[1] < 0
+        || s < plan->estimates[1])) {
+            plan->estimates[1] = s;
+            plan->threads = t;
+        }
+        double overlap = compute / t;
+        overlap = overlap > read ? overlap : read;
+        overlap = overlap > write ? overlap : write;
+        double m = (overlap + video.frames * p.frame_ns
+        + (t + 2) * p.team_ns) / 1e9;
+        if (plan->estimates[0] < 0 || m < plan->estimates[0]) {
+            plan->estimates[0] = m;
+            m_threads = t;
+        }
+    }
+
+    plan->memory_free = 0;
+    if (serial_fits && plan->estimates[2] <= plan->estimates[0]
+    && (s_cores == 0 || plan->estimates[2] <= plan->estimates[1])) {
+        plan->memory_free = 2;
+        plan->threads = 1;
+    } else if (s_cores > 0 && plan->estimates[1] <= plan->estimates[0]) {
+        plan->memory_free = 1;
+    } else {
+        plan->threads = m_threads;
+    }
+    plan->seconds = plan->estimates[plan->memory_free];
+    return 0;
+}
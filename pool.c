@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdatomic.h>
+
+// Scratch buffer pool: every slot holds one cache-line-aligned buffer per
+// kind (channel, frame, ring) and is owned by one thread at a time, usually
+// slot omp_get_thread_num(). Buffers only ever grow, so after the first
+// frame every request is served without touching the allocator.
+
+#define CACHE_LINE 64
+
+// Make room for slots buffer slots, -1 if the table cannot grow. Slots
+// that were never reserved get NULL from pool_scratch
+int pool_reserve(struct Context *ctx, int slots) {
+    struct BufferPool *pool = &ctx->pool;
+    if (slots <= pool->count) {
+        return 0;
+    }
+    struct PoolSlot *grown = (struct PoolSlot *)realloc(pool->slots,
+    slots * sizeof(struct PoolSlot));
+    if (!grown) {
+        fprintf(stderr, "Memory allocation failed for buffer pool!\n");
+        return -1;
+    }
+    memset(grown + pool->count, 0,
+    (slots - pool->count) * sizeof(struct PoolSlot));
+    pool->slots = grown;
+    pool->count = slots;
+    return 0;
+}
+
+unsigned char *pool_scratch(struct Context *ctx, int slot,
+                            enum ScratchKind kind, size_t size) {
+    struct BufferPool *pool = &ctx->pool;
+    if (slot >= pool->count) {
+        return NULL;
+    }
+    struct PoolBuffer *s = &pool->slots[slot].buffers[kind];
+    if (size == 0) {
+        size = 1;
+    }
+    if (size <= s->size) {
+        return s->data;
+    }
+
+    size_t rounded = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    double start = metrics_begin(ctx);
+    unsigned char *data = (unsigned char *)aligned_alloc(CACHE_LINE, rounded);
+    metrics_end(ctx, STAGE_ALLOC, start);
+    if (!data) {
+        return NULL;
+    }
+    free(s->data);
+
+    size_t in_use = atomic_fetch_add(&pool->in_use, rounded - s->size)
+    + rounded - s->size;
+    size_t high = atomic_load(&pool->high_water);
+    while (in_use > high
+    && !atomic_compare_exchange_weak(&pool->high_water, &high, in_use)) {
+    }
+
+    s->data = data;
+    s->size = rounded;
+    return data;
+}
+
+size_t pool_high_water(struct Context *ctx) {
+    return atomic_load(&ctx->pool.high_water);
+}
+
+void pool_release(struct Context *ctx) {
+    struct BufferPool *pool = &ctx->pool;
+    for (int i = 0; i < pool->count; ++i) {
+        for (int k = 0; k < SCRATCH_KINDS; ++k) {
+            free(pool->slots[i].buffers[k].data);
+        }
+    }
+    free(pool->slots);
+    pool->slots = NULL;
+    pool->count = 0;
+    atomic_store(&pool->in_use, 0);
+}
@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include "cli.h"
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <omp.h>
+
+// Job server: a fixed set of worker threads, each with its own warm
+// Context, takes jobs from a bounded queue fed by a Unix socket. A job is
+// the argument list of a normal runme command line, sent as NUL-terminated
+// strings followed by an empty one. The reply is one status line with the
+// job's wall and queue time, then the metrics report if it asked for one.
+
+#define REQUEST_MAX 8192
+#define MAX_ARGS 64
+#define REQUEST_TIMEOUT_S 10
+
+struct Server {
+    int listen_fd;
+    int workers;
+    int threads;        // OpenMP threads per job
+    int queue_size;
+    int *queue;         // accepted connections waiting for a worker
+    double *queued_at;
+    int head, count;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+static volatile sig_atomic_t stop_requested;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read a request up to its terminating empty string.
+// Returns the number of bytes read, or -1, also when the client sends
+// nothing for REQUEST_TIMEOUT_S seconds.
+static int read_request(int fd, char *buf, size_t size) {
+    size_t used = 0;
+    while (used < 2 || buf[used - 1] != '\0' || buf[used - 2] != '\0') {
+        if (used == size) {
+            return -1;
+        }
+        ssize_t n = recv(fd, buf + used, size - used, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        used += n;
+    }
+    return (int)used;
+}
+
+static void handle_job(struct Context *ctx, int fd, double queue_seconds) {
+    char request[REQUEST_MAX];
+    char reply[256];
+    if (read_request(fd, request, sizeof(request)) < 0) {
+        send_all(fd, "error bad request\n", 18);
+        return;
+    }
+    char *argv[MAX_ARGS + 1];
+    int argc = 0;
+    argv[argc++] = "runme";
+    for (char *arg = request; *arg && argc < MAX_ARGS;
+    arg += strlen(arg) + 1) {
+        argv[argc++] = arg;
+    }
+    argv[argc] = NULL;
+
+    struct Job job;
+    if (parse_job(argc, argv, &job) != 0) {
+        send_all(fd, "error invalid job\n", 18);
+        return;
+    }
+    // The server's own stdin and stdout are not the client's
+    if (is_stdio_path(job.input_file) || is_stdio_path(job.output_file)) {
+        send_all(fd, "error stdin/stdout jobs need runme\n", 35);
+        return;
+    }
+    // Planned jobs keep the worker's share of the cores
+    if (job.auto_plan) {
+        plan_job(&job);
+    }
+    context_set_settings(ctx, &job.settings);
+    double start = metrics_now();
+    int result = process_file(ctx, job.input_file, job.output_file, job.ops,
+    job.count, job.mode);
+    double wall = metrics_now() - start;
+    fflush(stdout);
+
+    int len = snprintf(reply, sizeof(reply), "%s wall_s=%.6f queue_s=%.6f\n",
+    result == 0 ? "ok" : "error", wall, queue_seconds);
+    if (send_all(fd, reply, len) != 0 || !job.settings.metrics) {
+        return;
+    }
+    char *report = NULL;
+    size_t report_size = 0;
+    FILE *out = open_memstream(&report, &report_size);
+    if (out) {
+        report_job(ctx, &job, out, wall);
+        fclose(out);
+        send_all(fd, report, report_size);
+        free(report);
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct Server *s = arg;
+    struct Context *ctx = context_create(NULL, s->threads);
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (s->count == 0 && !s->stopping) {
+            pthread_cond_wait(&s->ready, &s->lock);
+        }
+        if (s->count == 0) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        int fd = s->queue[s->head];
+        double queued_at = s->queued_at[s->head];
+        s->head = (s->head + 1) % s->queue_size;
+        s->count--;
+        pthread_mutex_unlock(&s->lock);
+
+        if (ctx) {
+            handle_job(ctx, fd, metrics_now() - queued_at);
+        } else {
+            send_all(fd, "error no context\n", 17);
+        }
+        close(fd);
+    }
+    context_destroy(ctx);
+    return NULL;
+}
+
+// Queue an accepted connection, or turn it away when the queue is full
+static void admit(struct Server *s, int fd) {
+    pthread_mutex_lock(&s->lock);
+    if (s->count == s->queue_size) {
+        pthread_mutex_unlock(&s->lock);
+        send_all(fd, "busy queue full\n", 16);
+        close(fd);
+        return;
+    }
+    int tail = (s->head + s->count) % s->queue_size;
+    s->queue[tail] = fd;
+    s->queued_at[tail] = metrics_now();
+    s->count++;
+    pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int open_socket(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+    // Replace a socket left behind by an earlier server, nothing else
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+    || chmod(path, 0600) != 0 || listen(fd, 64) != 0) {
+        perror("Error binding socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serve_main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage();
+        return 1;
+    }
+    const char *path = argv[2];
+    struct Server s = {0};
+    s.workers = 4;
+    s.queue_size = 64;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--jobs") == 0) {
+            s.workers = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--queue") == 0) {
+            s.queue_size = atoi(argv[i + 1]);
+        } else {
+            printf("Error: Unknown option %s\n", argv[i]);
+            print_usage();
+            return 1;
+        }
+    }
+    if (s.workers < 1 || s.queue_size < 1) {
+        print_usage();
+        return 1;
+    }
+    // Split the cores between the concurrent jobs
+    s.threads = omp_get_num_procs() / s.workers;
+    if (s.threads < 1) {
+        s.threads = 1;
+    }
+
+    s.queue = (int *)malloc(s.queue_size * sizeof(int));
+    s.queued_at = (double *)malloc(s.queue_size * sizeof(double));
+    pthread_t *threads = (pthread_t *)malloc(s.workers * sizeof(pthread_t));
+    if (!s.queue || !s.queued_at || !threads) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return 1;
+    }
+    s.listen_fd = open_socket(path);
+    if (s.listen_fd < 0) {
+        return 1;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.ready, NULL);
+
+    // Workers start with the signals blocked, so SIGINT/SIGTERM always
+    // interrupt the accept below
+    struct sigaction sa = {0};
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    int started = 0;
+    while (started < s.workers
+    && pthread_create(&threads[started], NULL, worker_main, &s) == 0) {
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    printf("Serving on %s with %d workers, %d threads each\n", path, started,
+    s.threads);
+    fflush(stdout);
+
+    while (started > 0 && !stop_requested) {
+        int fd = accept4(s.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Error accepting job");
+            break;
+        }
+        // A client that stalls before ending its request must not hold
+        // a worker forever
+        struct timeval timeout = {.tv_sec = REQUEST_TIMEOUT_S};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        admit(&s, fd);
+    }
+
+    // Finish the queued jobs, then stop
+    pthread_mutex_lock(&s.lock);
+    s.stopping = 1;
+    pthread_cond_broadcast(&s.ready);
+    pthread_mutex_unlock(&s.lock);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    close(s.listen_fd);
+    unlink(path);
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.ready);
+    free(threads);
+    free(s.queue);
+    free(s.queued_at);
+    printf("Server on %s stopped\n", path);
+    return 0;
+}
+
+// Send argv[3..] as one job and print the reply. Exits with 0 only if
+// the job succeeded.
+int submit_main(int argc, char *argv[]) {
+    if (argc < 6) {
+        print_usage();
+        return 1;
+    }
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(argv[2]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path is too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[2]);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Error connecting to server");
+        return 1;
+    }
+
+    char request[REQUEST_MAX];
+    size_t used = 0;
+    for (int i = 3; i < argc; ++i) {
+        size_t len = strlen(argv[i]) + 1;
+        if (used + len + 1 > sizeof(request)) {
+            fprintf(stderr, "Error: Job is too long\n");
+            close(fd);
+            return 1;
+        }
+        memcpy(request + used, argv[i], len);
+        used += len;
+    }
+    request[used++] = '\0';
+    // A server with a full queue answers without reading the job,
+    // so a failed send still leaves a reply to read
+    send_all(fd, request, used);
+    shutdown(fd, SHUT_WR);
+
+    char reply[4096];
+    size_t got = 0;
+    ssize_t n;
+    while ((n = recv(fd, reply + got, sizeof(reply) - 1 - got, 0)) > 0) {
+        got += n;
+        if (got == sizeof(reply) - 1) {
+            break;
+        }
+    }
+    close(fd);
+    reply[got] = '\0';
+    fputs(reply, stdout);
+    return strncmp(reply, "ok ", 3) == 0 ? 0 : 1;
+}
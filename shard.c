@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <omp.h>
+
+// Sharding. Frames are fixed-size and stored one after another, so frame
+// f of any video starts at HEADER_SIZE + f * frame_size and a run of
+// frames is a single byte range. --frames a:b processes frames [a, b) as
+// a video of its own; split_file cuts a video into shards with their own
+// headers; merge_files joins processed shards back together. A reversed
+// chain reverses each shard, so the shards are joined last one first.
+
+// Bytes of frames per read in range_process
+#define SHARD_BLOCK_BYTES (8 << 20)
+
+// Header of a video with the geometry of video and the given frame count
+static void shard_header(unsigned char *head, const struct Video *video,
+                         int64_t frames) {
+    memcpy(head, &frames, sizeof(int64_t));
+    head[8] = video->channels;
+    head[9] = video->height;
+    head[10] = video->width;
+}
+
+// Shards are raw videos; containers and views have to be decoded first
+static int raw_video(const char *path) {
+    if (is_container(path) || is_view(path)) {
+        printf("Error: %s is not a raw video; decode it before sharding\n",
+        path);
+        return 0;
+    }
+    return 1;
+}
+
+static int read_video_header(int fd, const char *path, struct Video *video) {
+    unsigned char head[HEADER_SIZE];
+    if (pread_full(fd, head, HEADER_SIZE, 0) != 0
+    || parse_header(head, video) != 0) {
+        fprintf(stderr, "Error: Failed to read video header of %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int range_process(struct Context *ctx, const char *input_file,
+                  const char *output_file, const struct Operation *ops,
+                  int count, int memory_free) {
+    if (is_stdio_path(input_file) || is_stdio_path(output_file)) {
+        printf("Error: --frames needs file paths, not -\n");
+        return -1;
+    }
+    int in_fd = open(input_file, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    struct Video video;
+    double start = metrics_begin(ctx);
+    if (read_video_header(in_fd, input_file, &video) != 0) {
+        close(in_fd);
+        return -1;
+    }
+    metrics_end(ctx, STAGE_HEADER, start);
+    int reversed = check_stages(ops, count, &video);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        close(in_fd);
+        return -1;
+    }
+    int64_t first = ctx->settings.first_frame;
+    int64_t last = ctx->settings.last_frame > 0 ? ctx->settings.last_frame
+    : video.frames;
+    if (first >= last || last > video.frames) {
+        printf("Error: Frames %ld:%ld are outside the video (%ld frames)\n",
+        first, last, video.frames);
+        close(in_fd);
+        return -1;
+    }
+    int out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Error opening output file");
+        close(in_fd);
+        return -1;
+    }
+
+    size_t channel_size = video.height * video.width;
+    size_t frame_size = video.channels * channel_size;
+    int64_t frames = last - first;
+    int64_t k = frame_size > 0 ? SHARD_BLOCK_BYTES / frame_size : 1;
+    k = k < 1 ? 1 : (k > IOV_MAX ? IOV_MAX : k);
+    k = k < frames ? k : frames;
+    unsigned char *block = pool_reserve(ctx, omp_get_max_threads()) == 0
+    ? pool_scratch(ctx, 0, SCRATCH_RING, k * frame_size) : NULL;
+    unsigned char head[HEADER_SIZE];
+    shard_header(head, &video, frames);
+    int failed = !block || pwrite_full(out_fd, head, HEADER_SIZE, 0) != 0;
+    if (failed) {
+        perror("Error writing output header");
+    }
+    metrics_count(ctx, HEADER_SIZE, HEADER_SIZE, 0);
+
+    for (int64_t done = 0; !failed && done < frames; done += k) {
+        int64_t n = frames - done < k ? frames - done : k;
+        start = metrics_begin(ctx);
+        if (pread_full(in_fd, block, n * frame_size,
+        HEADER_SIZE + (first + done) * frame_size) != 0) {
+            fprintf(stderr, "Error reading frames from %ld\n", first + done);
+            failed = 1;
+            break;
+        }
+        metrics_end(ctx, STAGE_READ, start);
+        start = metrics_begin(ctx);
+        #pragma omp parallel if (memory_free == 1) reduction(|:failed)
+        {
+            unsigned char *temp_channel = pool_scratch(ctx,
+            omp_get_thread_num(), SCRATCH_CHANNEL, channel_size);
+            failed = !temp_channel;
+            #pragma omp for
+            for (int64_t f = 0; f < n; ++f) {
+                if (temp_channel) {
+                    apply_stages(block + f * frame_size, ops, count,
+                    channel_size, temp_channel);
+                }
+            }
+        }
+        metrics_end(ctx, STAGE_COMPUTE, start);
+        if (failed) {
+            fprintf(stderr, "Memory allocation failed for temp channel!\n");
+            break;
+        }
+        start = metrics_begin(ctx);
+        if (reversed) {
+            // Output frame j of the range is input frame frames - 1 - j
+            struct iovec iov[IOV_MAX];
+            for (int64_t i = 0; i < n; ++i) {
+                iov[i].iov_base = block + (n - 1 - i) * frame_size;
+                iov[i].iov_len = frame_size;
+            }
+            failed = pwritev_full(out_fd, iov, (int)n, HEADER_SIZE
+            + (frames - done - n) * frame_size) != 0;
+        } else {
+            failed = pwrite_full(out_fd, block, n * frame_size,
+            HEADER_SIZE + done * frame_size) != 0;
+        }
+        metrics_end(ctx, STAGE_WRITE, start);
+        metrics_count(ctx, n * frame_size, n * frame_size, n);
+        if (failed) {
+            perror("Error writing frames");
+        }
+    }
+
+    close(in_fd);
+    if (close(out_fd) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        return -1;
+    }
+    printf("Frames %ld to %ld processed and saved to %s\n", first, last - 1,
+    output_file);
+    return 0;
+}
+
+// Copy len bytes between the files, in the kernel where it can
+static int copy_bytes(struct Context *ctx, int in_fd, off_t in_offset,
+                      int out_fd, off_t out_offset, size_t len) {
+    size_t bounce_size = len < SHARD_BLOCK_BYTES ? len : SHARD_BLOCK_BYTES;
+    unsigned char *bounce = pool_scratch(ctx, 0, SCRATCH_RING,
+    bounce_size);
+    int kernel_copy = 1;
+    double start = metrics_begin(ctx);
+    int result = len == 0 ? 0 : (bounce ? copy_range(in_fd, in_offset,
+    out_fd, out_offset, len, bounce, bounce_size, &kernel_copy) : -1);
+    metrics_end(ctx, STAGE_WRITE, start);
+    metrics_count(ctx, len, len, 0);
+    return result;
+}
+
+int split_file(struct Context *ctx, const char *input_file,
+               const char *prefix, int shards) {
+    if (!raw_video(input_file)) {
+        return -1;
+    }
+    int in_fd = open(input_file, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    struct Video video;
+    if (read_video_header(in_fd, input_file, &video) != 0) {
+        close(in_fd);
+        return -1;
+    }
+    if (shards < 1 || shards > video.frames) {
+        printf("Error: Cannot split %ld frames into %d shards\n",
+        video.frames, shards);
+        close(in_fd);
+        return -1;
+    }
+    size_t frame_size = video.channels * video.height * video.width;
+    int failed = pool_reserve(ctx, 1) != 0;
+    for (int i = 0; i < shards && !failed; ++i) {
+        // Shard i holds frames [i * N / K, (i + 1) * N / K)
+        int64_t first = video.frames * i / shards;
+        int64_t last = video.frames * (i + 1) / shards;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.%d.bin", prefix, i);
+        if (same_file(input_file, path)) {
+            printf("Error: Shard %s would overwrite the input\n", path);
+            failed = 1;
+            break;
+        }
+        int out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            perror("Error opening shard file");
+            failed = 1;
+            break;
+        }
+        unsigned char head[HEADER_SIZE];
+        shard_header(head, &video, last - first);
+        failed = pwrite_full(out_fd, head, HEADER_SIZE, 0) != 0
+        || copy_bytes(ctx, in_fd, HEADER_SIZE + first * frame_size, out_fd,
+        HEADER_SIZE, (last - first) * frame_size) != 0;
+        if (close(out_fd) != 0 || failed) {
+            fprintf(stderr, "Error writing shard %s\n", path);
+            failed = 1;
+            break;
+        }
+        printf("Frames %ld to %ld saved to %s\n", first, last - 1, path);
+    }
+    close(in_fd);
+    return failed ? -1 : 0;
+}
+
+int merge_files(struct Context *ctx, const char *output_file,
+                const char *const *shard_files, int shards, int reversed) {
+    if (shards < 1) {
+        printf("Error: No shards to merge.\n");
+        return -1;
+    }
+    for (int i = 0; i < shards; ++i) {
+        if (!raw_video(shard_files[i])) {
+            return -1;
+        }
+    }
+    int *fds = (int *)malloc(shards * sizeof(int));
+    struct Video *videos = (struct Video *)malloc(shards
+    * sizeof(struct Video));
+    if (!fds || !videos) {
+        fprintf(stderr, "Memory allocation failed for shard list!\n");
+        free(fds);
+        free(videos);
+        return -1;
+    }
+    // Check that every shard opens and that they share one geometry
+    int opened = 0, failed = 0;
+    int64_t frames = 0;
+    for (; opened < shards; ++opened) {
+        fds[opened] = open(shard_files[opened], O_RDONLY);
+        if (fds[opened] < 0) {
+            perror("Error opening shard file");
+            failed = 1;
+            break;
+        }
+        if (read_video_header(fds[opened], shard_files[opened],
+        &videos[opened]) != 0) {
+            failed = 1;
+            opened++;
+            break;
+        }
+        struct Video *v = &videos[opened];
+        if (v->channels != videos[0].channels || v->height != videos[0].height
+        || v->width != videos[0].width) {
+            fprintf(stderr, "Error: %s does not match the size of %s\n",
+            shard_files[opened], shard_files[0]);
+            failed = 1;
+            opened++;
+            break;
+        }
+        frames += v->frames;
+    }
+
+    for (int i = 0; !failed && i < shards; ++i) {
+        if (same_file(shard_files[i], output_file)) {
+            printf("Error: Output %s is one of the shards\n", output_file);
+            failed = 1;
+        }
+    }
+    int out_fd = failed ? -1 : open(output_file,
+    O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (!failed && out_fd < 0) {
+        perror("Error opening output file");
+        failed = 1;
+    }
+    if (!failed && pool_reserve(ctx, 1) != 0) {
+        close(out_fd);
+        failed = 1;
+    }
+    if (!failed) {
+        size_t frame_size = videos[0].channels * videos[0].height
+        * videos[0].width;
+        unsigned char head[HEADER_SIZE];
+        shard_header(head, &videos[0], frames);
+        failed = pwrite_full(out_fd, head, HEADER_SIZE, 0) != 0;
+        off_t offset = HEADER_SIZE;
+        for (int i = 0; i < shards && !failed; ++i) {
+            int s = reversed ? shards - 1 - i : i;
+            size_t len = videos[s].frames * frame_size;
+            failed = copy_bytes(ctx, fds[s], HEADER_SIZE, out_fd, offset, len)
+            != 0;
+            offset += len;
+        }
+        if (failed) {
+            perror("Error writing merged video");
+        }
+        if (close(out_fd) != 0) {
+            failed = 1;
+        }
+    }
+    for (int i = 0; i < opened; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    free(fds);
+    free(videos);
+    if (failed) {
+        return -1;
+    }
+    printf("%d shards (%ld frames) merged into %s\n", shards, frames,
+    output_file);
+    return 0;
+}
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include "cli.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Shard subcommands. --split and --merge wrap split_file and merge_files
+// for jobs spread over machines: split, process each shard anywhere (or
+// give every machine a --frames range of the shared input), then merge.
+// --shard-test does the whole round trip on one machine, with one runme
+// process per --frames range, and checks the merged result against a
+// single-pass run of the same job.
+
+#define COMPARE_CHUNK (1 << 20)
+
+// Offset of the first differing byte of the two files, -1 if they match
+// and -2 if either cannot be read
+static long first_difference(const char *path_a, const char *path_b) {
+    FILE *a = fopen(path_a, "rb");
+    FILE *b = fopen(path_b, "rb");
+    unsigned char *buf_a = (unsigned char *)malloc(COMPARE_CHUNK);
+    unsigned char *buf_b = (unsigned char *)malloc(COMPARE_CHUNK);
+    long result = a && b && buf_a && buf_b ? -1 : -2;
+    long offset = 0;
+    while (result == -1) {
+        size_t n_a = fread(buf_a, 1, COMPARE_CHUNK, a);
+        size_t n_b = fread(buf_b, 1, COMPARE_CHUNK, b);
+        size_t n = n_a < n_b ? n_a : n_b;
+        for (size_t i = 0; i < n && result == -1; ++i) {
+            if (buf_a[i] != buf_b[i]) {
+                result = offset + i;
+            }
+        }
+        if (result == -1 && n_a != n_b) {
+            result = offset + n;
+        }
+        if (n_a == 0 || n_b == 0) {
+            break;
+        }
+        offset += n;
+    }
+    if (a) {
+        fclose(a);
+    }
+    if (b) {
+        fclose(b);
+    }
+    free(buf_a);
+    free(buf_b);
+    return result;
+}
+
+// Run "runme input shard --frames first:last rest..." with its messages
+// on stdout discarded
+static pid_t launch_shard(char *argv[], int argc, const char *shard,
+                          long first, long last) {
+    char range[64];
+    snprintf(range, sizeof(range), "%ld:%ld", first, last);
+    char **child = (char **)malloc((argc + 1) * sizeof(char *));
+    if (!child) {
+        return -1;
+    }
+    child[0] = argv[0];
+    child[1] = argv[2];
+    child[2] = (char *)shard;
+    child[3] = "--frames";
+    child[4] = range;
+    for (int i = 5; i < argc; ++i) {
+        child[i] = argv[i];
+    }
+    child[argc] = NULL;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+        }
+        execv("/proc/self/exe", child);
+        perror("Error starting shard process");
+        _exit(127);
+    }
+    free(child);
+    return pid;
+}
+
+// ./runme --shard-test input output K [-S/-M] [options] operation ...
+static int shard_test(int argc, char *argv[]) {
+    int shards = atoi(argv[4]);
+    // The job without the shard count, to check it and learn its order
+    char **job_argv = (char **)malloc(argc * sizeof(char *));
+    if (!job_argv) {
+        return 1;
+    }
+    job_argv[0] = argv[0];
+    job_argv[1] = argv[2];
+    job_argv[2] = argv[3];
+    for (int i = 5; i < argc; ++i) {
+        job_argv[i - 2] = argv[i];
+    }
+    struct Job job;
+    int parsed = parse_job(argc - 2, job_argv, &job);
+    free(job_argv);
+    if (parsed != 0) {
+        return 1;
+    }
+    if (job.settings.first_frame > 0 || job.settings.last_frame > 0) {
+        printf("Error: --shard-test sets --frames for each shard itself\n");
+        return 1;
+    }
+    // The shards are merged as raw videos and compared byte for byte
+    const char *option = job.settings.compress ? "--compress"
+    : job.settings.view ? "--view" : job.settings.in_place ? "--in-place"
+    : job.settings.cache_dir ? "--cache" : NULL;
+    if (option) {
+        printf("Error: --shard-test cannot be combined with %s\n", option);
+        return 1;
+    }
+    if (is_container(job.input_file) || is_view(job.input_file)) {
+        printf("Error: --shard-test needs a raw video, not %s\n",
+        job.input_file);
+        return 1;
+    }
+    int in_fd = open(job.input_file, O_RDONLY);
+    unsigned char head[HEADER_SIZE];
+    struct Video video;
+    int readable = in_fd >= 0 && pread_full(in_fd, head, HEADER_SIZE, 0) == 0
+    && parse_header(head, &video) == 0;
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (!readable) {
+        fprintf(stderr, "Error: Failed to read video header\n");
+        return 1;
+    }
+    int reversed = check_stages(job.ops, job.count, &video);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        return 1;
+    }
+    if (shards < 1 || shards > video.frames) {
+        printf("Error: Cannot split %ld frames into %d shards\n",
+        video.frames, shards);
+        return 1;
+    }
+
+    char (*names)[PATH_MAX] = malloc(shards * sizeof(*names));
+    pid_t *pids = (pid_t *)malloc(shards * sizeof(pid_t));
+    if (!names || !pids) {
+        fprintf(stderr, "Memory allocation failed for shard list!\n");
+        free(names);
+        free(pids);
+        return 1;
+    }
+    // Every file the test writes must leave the input alone
+    char single[PATH_MAX];
+    snprintf(single, sizeof(single), "%s.single", job.output_file);
+    int clash = same_file(job.input_file, job.output_file)
+    || same_file(job.input_file, single);
+    for (int i = 0; i < shards; ++i) {
+        snprintf(names[i], PATH_MAX, "%s.%d", job.output_file, i);
+        clash = clash || same_file(job.input_file, names[i]);
+    }
+    if (clash) {
+        printf("Error: --shard-test would overwrite its input %s\n",
+        job.input_file);
+        free(names);
+        free(pids);
+        return 1;
+    }
+    double start = metrics_now();
+    int failed = 0;
+    for (int i = 0; i < shards; ++i) {
+        pids[i] = launch_shard(argv, argc, names[i],
+        video.frames * i / shards, video.frames * (i + 1) / shards);
+        failed |= pids[i] < 0;
+    }
+    for (int i = 0; i < shards; ++i) {
+        int status;
+        if (pids[i] > 0 && (waitpid(pids[i], &status, 0) < 0
+        || !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            fprintf(stderr, "Shard %d failed\n", i);
+            failed = 1;
+        }
+    }
+
+    struct Context *ctx = context_create(&job.settings, job.threads);
+    const char **paths = (const char **)malloc(shards * sizeof(char *));
+    for (int i = 0; paths && i < shards; ++i) {
+        paths[i] = names[i];
+    }
+    failed = failed || !ctx || !paths || merge_files(ctx, job.output_file,
+    paths, shards, reversed) != 0;
+    double sharded = metrics_now() - start;
+
+    start = metrics_now();
+    failed = failed || process_file(ctx, job.input_file, single, job.ops,
+    job.count, job.mode) != 0;
+    double one_pass = metrics_now() - start;
+    long difference = failed ? -2 : first_difference(job.output_file,
+    single);
+
+    if (!failed) {
+        printf("Sharded: %.3f s over %d processes, single pass: %.3f s\n",
+        sharded, shards, one_pass);
+        if (difference == -1) {
+            printf("Sharded output is identical to the single pass\n");
+        } else {
+            printf("Sharded output differs from the single pass at byte"
+            " %ld\n", difference);
+        }
+    }
+    for (int i = 0; i < shards; ++i) {
+        unlink(names[i]);
+    }
+    unlink(single);
+    free(paths);
+    free(names);
+    free(pids);
+    context_destroy(ctx);
+    return !failed && difference == -1 ? 0 : 1;
+}
+
+int split_main(int argc, char *argv[]) {
+    if (strcmp(argv[1], "--shard-test") == 0) {
+        if (argc < 6) {
+            print_usage();
+            return 1;
+        }
+        return shard_test(argc, argv);
+    }
+    int merge = strcmp(argv[1], "--merge") == 0;
+    int reversed = merge && argc > 3 && strcmp(argv[3], "--reverse") == 0;
+    if ((!merge && argc != 5) || (merge && argc < 4 + reversed)) {
+        print_usage();
+        return 1;
+    }
+    struct Context *ctx = context_create(NULL, 1);
+    if (!ctx) {
+        return 1;
+    }
+    // ./runme --split input K prefix
+    // ./runme --merge output [--reverse] shard ...
+    int result = merge ? merge_files(ctx, argv[2],
+    (const char *const *)argv + 3 + reversed, argc - 3 - reversed, reversed)
+    : split_file(ctx, argv[2], argv[4], atoi(argv[3]));
+    context_destroy(ctx);
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+#include <omp.h>
+
+// Bounded-memory streaming engine for -M mode: one reader thread, a pool
+// of compute workers and one writer thread, connected by a ring of
+// fixed-size slots. Each slot carries a batch of whole frames, read and
+// written with one call. Batch b always lives in slot b % slots, and a
+// slot moves FREE -> FILLED -> COMPUTED -> FREE, so the writer can emit
+// batches in order without any locks. A stage that has to wait spins
+// briefly, then sleeps on a futex until the slot changes.
+
+// Slot size used when the cache sizes are unknown
+#define DEFAULT_SLOT_BYTES (256 << 10)
+// Polls of a slot before a waiting stage yields, then before it sleeps
+#define WAIT_SPINS 64
+#define WAIT_YIELDS 128
+
+enum { SLOT_FREE, SLOT_FILLED, SLOT_COMPUTED };
+
+struct Slot {
+    _Atomic int phase;
+    _Atomic int64_t frame;      // batch currently held by the slot
+    _Atomic uint32_t changes;   // futex word, bumped on every phase change
+    _Atomic int sleepers;       // stages asleep on changes
+    unsigned char *data;
+};
+
+struct Stream {
+    const struct StreamJob *job;
+    struct Slot *slots;
+    int slot_count;
+    int64_t batch;                 // frames per slot
+    int64_t batches;
+    _Atomic int64_t next_compute;  // next batch a worker may claim
+    _Atomic int next_worker;       // hands out pool slots to the workers
+    _Atomic int failed;
+};
+
+// Spin briefly, then give the CPU away while the other stage catches up;
+// returns 0 once the waiter should sleep instead
+static int wait_backoff(int *spins) {
+    if (++*spins < WAIT_SPINS) {
+#if defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+        return 1;
+    }
+    if (*spins < WAIT_SPINS + WAIT_YIELDS) {
+        sched_yield();
+        return 1;
+    }
+    return 0;
+}
+
+// Wake the stages asleep on the slot. The sleepers count is read after
+// the bump, and a sleeper announces itself before its futex compares the
+// word, so either the wake finds it or its wait returns at once.
+static void wake_slot(struct Slot *slot) {
+    atomic_fetch_add(&slot->changes, 1);
+    if (atomic_load(&slot->sleepers) > 0) {
+        syscall(SYS_futex, &slot->changes, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+        NULL, 0);
+    }
+}
+
+static void set_phase(struct Slot *slot, int phase) {
+    atomic_store(&slot->phase, phase);
+    wake_slot(slot);
+}
+
+// Stop every stage, including the ones asleep on a slot
+static void fail_stream(struct Stream *s) {
+    atomic_store(&s->failed, 1);
+    for (int i = 0; i < s->slot_count; ++i) {
+        wake_slot(&s->slots[i]);
+    }
+}
+
+// Frames in batch b, the last one may be short
+static int64_t batch_size(const struct Stream *s, int64_t b) {
+    int64_t left = s->job->frames - b * s->batch;
+    return left < s->batch ? left : s->batch;
+}
+
+static long cache_size(int name, const char *index) {
+    long size = sysconf(name);
+    if (size > 0) {
+        return size;
+    }
+    // Some libcs report 0, sysfs has the same numbers in KB
+    char path[96];
+    snprintf(path, sizeof(path),
+    "/sys/devices/system/cpu/cpu0/cache/%s/size", index);
+    FILE *file = fopen(path, "r");
+    if (file) {
+        if (fscanf(file, "%ldK", &size) != 1) {
+            size = 0;
+        }
+        fclose(file);
+    }
+    return size > 0 ? size * 1024 : 0;
+}
+
+// Frames per slot: half of L2 per slot, so a worker's batch and its
+// scratch stay in its own L2, with the whole ring inside half of L3
+static int64_t auto_batch(size_t frame_size, int slot_count) {
+    long l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, "index2");
+    long l3 = cache_size(_SC_LEVEL3_CACHE_SIZE, "index3");
+    size_t slot_bytes = l2 > 0 ? l2 / 2 : DEFAULT_SLOT_BYTES;
+    if (l3 > 0 && slot_bytes * slot_count > (size_t)l3 / 2) {
+        slot_bytes = l3 / 2 / slot_count;
+    }
+    int64_t batch = frame_size > 0 ? slot_bytes / frame_size : 1;
+    return batch < 1 ? 1 : batch;
+}
+
+// Read frames first to first + n - 1 into the slot back to front, with
+// one scatter read that leaves the stream position alone
+static int read_reversed(const struct StreamJob *job, unsigned char *data,
+                         int64_t first, int64_t n) {
+    struct iovec iov[IOV_MAX];
+    for (int64_t k = 0; k < n; ++k) {
+        iov[k].iov_base = data + (n - 1 - k) * job->frame_size;
+        iov[k].iov_len = job->frame_size;
+    }
+    int fd = fileno(job->input);
+    off_t offset = HEADER_SIZE + first * job->frame_size;
+    struct iovec *next = iov;
+    int count = (int)n;
+    double start = metrics_begin(job->ctx);
+    while (count > 0) {
+        ssize_t got = preadv(fd, next, count, offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        offset += got;
+        while (count > 0 && (size_t)got >= next->iov_len) {
+            got -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = (unsigned char *)next->iov_base + got;
+            next->iov_len -= got;
+        }
+    }
+    metrics_end(job->ctx, STAGE_READ, start);
+    metrics_count(job->ctx, n * job->frame_size, 0, 0);
+    return 0;
+}
+
+// Wait until the slot reaches the phase for the given batch,
+// returns 0 if another stage failed in the meantime
+static int wait_slot(struct Stream *s, struct Slot *slot, int phase,
+                     int64_t frame) {
+    int spins = 0;
+    for (;;) {
+        // Read the word first: any change after this makes the futex
+        // return instead of sleeping
+        uint32_t seen = atomic_load(&slot->changes);
+        if (atomic_load_explicit(&slot->phase, memory_order_acquire) == phase
+        && (frame < 0 || atomic_load_explicit(&slot->frame,
+        memory_order_relaxed) == frame)) {
+            return 1;
+        }
+        if (atomic_load_explicit(&s->failed, memory_order_relaxed)) {
+            return 0;
+        }
+        if (!wait_backoff(&spins)) {
+            atomic_fetch_add(&slot->sleepers, 1);
+            syscall(SYS_futex, &slot->changes, FUTEX_WAIT_PRIVATE, seen, NULL,
+            NULL, 0);
+            atomic_fetch_sub(&slot->sleepers, 1);
+        }
+    }
+}
+
+static void *reader_thread(void *arg) {
+    struct Stream *s = arg;
+    const struct StreamJob *job = s->job;
+    struct Context *ctx = job->ctx;
+    for (int64_t i = 0; i < s->batches; ++i) {
+        struct Slot *slot = &s->slots[i % s->slot_count];
+        if (!wait_slot(s, slot, SLOT_FREE, -1)) {
+            return NULL;
+        }
+        int64_t n = batch_size(s, i);
+        // A reversed run takes the batches from the tail backward
+        int64_t first = job->reversed ? job->frames - i * s->batch - n
+        : i * s->batch;
+        int failed = job->reversed
+        ? read_reversed(job, slot->data, first, n) != 0
+        : metered_fread(ctx, slot->data, job->frame_size, n, job->input)
+        != (size_t)n;
+        if (failed) {
+            fprintf(stderr, "Error reading frames %ld to %ld\n", first,
+            first + n - 1);
+            fail_stream(s);
+            return NULL;
+        }
+        atomic_store_explicit(&slot->frame, i, memory_order_relaxed);
+        set_phase(slot, SLOT_FILLED);
+    }
+    return NULL;
+}
+
+static void *worker_thread(void *arg) {
+    struct Stream *s = arg;
+    const struct StreamJob *job = s->job;
+    struct Context *ctx = job->ctx;
+    unsigned char *scratch = NULL;
+    if (job->scratch_size > 0) {
+        scratch = pool_scratch(ctx, atomic_fetch_add(
+        &s->next_worker, 1), SCRATCH_CHANNEL, job->scratch_size);
+        if (!scratch) {
+            fprintf(stderr, "Memory allocation failed for scratch!\n");
+            fail_stream(s);
+            return NULL;
+        }
+    }
+    for (;;) {
+        int64_t i = atomic_fetch_add(&s->next_compute, 1);
+        if (i >= s->batches) {
+            break;
+        }
+        struct Slot *slot = &s->slots[i % s->slot_count];
+        if (!wait_slot(s, slot, SLOT_FILLED, i)) {
+            break;
+        }
+        double start = metrics_begin(ctx);
+        int64_t n = batch_size(s, i);
+        for (int64_t k = 0; k < n; ++k) {
+            job->process(slot->data + k * job->frame_size, scratch,
+            job->arg);
+        }
+        metrics_end(ctx, STAGE_COMPUTE, start);
+        set_phase(slot, SLOT_COMPUTED);
+    }
+    return NULL;
+}
+
+static void *writer_thread(void *arg) {
+    struct Stream *s = arg;
+    const struct StreamJob *job = s->job;
+    struct Context *ctx = job->ctx;
+    for (int64_t i = 0; i < s->batches; ++i) {
+        struct Slot *slot = &s->slots[i % s->slot_count];
+        if (!wait_slot(s, slot, SLOT_COMPUTED, i)) {
+            return NULL;
+        }
+        int64_t n = batch_size(s, i);
+        if (metered_fwrite(ctx, slot->data, job->frame_size, n, job->output)
+        != (size_t)n) {
+            fprintf(stderr, "Error writing frames %ld to %ld\n",
+            i * s->batch, i * s->batch + n - 1);
+            fail_stream(s);
+            return NULL;
+        }
+        metrics_count(ctx, 0, 0, n);
+        set_phase(slot, SLOT_FREE);
+    }
+    return NULL;
+}
+
+int stream_process(const struct StreamJob *job) {
+    struct Context *ctx = job->ctx;
+    int workers = job->workers > 0 ? job->workers : omp_get_max_threads();
+    if (workers < 1) {
+        workers = 1;
+    }
+    int slot_count = job->slots > 0 ? job->slots : 2 * workers + 2;
+    int64_t batch = job->batch > 0 ? job->batch
+    : auto_batch(job->frame_size, slot_count);
+    if (batch > IOV_MAX) {
+        batch = IOV_MAX;
+    }
+    if (batch > job->frames) {
+        batch = job->frames > 0 ? job->frames : 1;
+    }
+
+    struct Stream s;
+    s.job = job;
+    s.slot_count = slot_count;
+    s.batch = batch;
+    // Empty frames leave nothing to move; stdio counts them as failed
+    s.batches = job->frame_size > 0 ? (job->frames + batch - 1) / batch : 0;
+    atomic_init(&s.next_compute, 0);
+    atomic_init(&s.next_worker, 0);
+    atomic_init(&s.failed, 0);
+    s.slots = (struct Slot *)calloc(slot_count, sizeof(struct Slot));
+    unsigned char *ring = pool_reserve(ctx, workers) == 0
+    ? pool_scratch(ctx, 0, SCRATCH_RING, slot_count * batch * job->frame_size)
+    : NULL;
+    pthread_t *threads = (pthread_t *)malloc((workers + 2) *
+    sizeof(pthread_t));
+    if (!s.slots || !ring || !threads) {
+        fprintf(stderr, "Memory allocation failed for stream ring!\n");
+        free(s.slots);
+        free(threads);
+        return -1;
+    }
+    for (int i = 0; i < slot_count; ++i) {
+        atomic_init(&s.slots[i].phase, SLOT_FREE);
+        atomic_init(&s.slots[i].changes, 0);
+        atomic_init(&s.slots[i].sleepers, 0);
+        atomic_init(&s.slots[i].frame, -1);
+        s.slots[i].data = ring + i * batch * job->frame_size;
+    }
+
+    int started = 0;
+    if (pthread_create(&threads[started], NULL, reader_thread, &s) == 0) {
+        started++;
+    }
+    if (started == 1
+    && pthread_create(&threads[started], NULL, writer_thread, &s) == 0) {
+        started++;
+    }
+    for (int i = 0; started >= 2 && i < workers; ++i) {
+        if (pthread_create(&threads[started], NULL, worker_thread, &s) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started < 3) {
+        fprintf(stderr, "Error starting stream threads\n");
+        fail_stream(&s);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int failed = atomic_load(&s.failed);
+    free(threads);
+    free(s.slots);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// io_uring backend for --uring: a ring of depth frame slots, each cycling
+// read -> stages -> write, with every read and write in flight at once and
+// submitted in batches. Reverse only changes which input offset a slot
+// reads, so the random-access pattern of a reversed run costs no seeks.
+// Built on the raw syscalls, so no liburing is needed; where the header,
+// the syscalls or the read/write opcodes are missing, uring_supported
+// says no and the caller keeps the stdio path.
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct Ring {
+    int fd;
+    unsigned entries;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *sq_head, *sq_tail, *cq_head, *cq_tail;
+    unsigned *sq_mask, *sq_array, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending;  // queued but not yet submitted
+    unsigned running;  // submitted, completion not yet reaped
+    int fixed;         // slot buffers registered with the kernel
+};
+
+static int ring_open(struct Ring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+    r->entries = p.sq_entries;
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes
+    + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size) {
+            r->sq_map_size = r->cq_map_size;
+        }
+        r->cq_map_size = 0;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_map = r->sq_map;
+    if (r->sq_map != MAP_FAILED && r->cq_map_size > 0) {
+        r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+    IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED
+    || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    char *sq = r->sq_map;
+    char *cq = r->cq_map;
+    r->sq_head = (_Atomic unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (_Atomic unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (_Atomic unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (_Atomic unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void ring_close(struct Ring *r) {
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_map_size > 0) {
+        munmap(r->cq_map, r->cq_map_size);
+    }
+    munmap(r->sq_map, r->sq_map_size);
+    close(r->fd);
+}
+
+// Queue one read or write of len bytes at offset. The ring has an entry
+// for every slot, so there is always room.
+static void ring_queue(struct Ring *r, int write, int fd, unsigned char *buf,
+                       unsigned len, off_t offset, uint64_t user_data) {
+    unsigned tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (r->fixed) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    r->sq_array[index] = index;
+    atomic_store_explicit(r->sq_tail, tail + 1, memory_order_release);
+    r->pending++;
+}
+
+// Submit everything queued and wait for at least one completion
+static int ring_submit_wait(struct Ring *r) {
+    for (;;) {
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, r->pending, 1,
+        IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0) {
+            r->pending -= n;
+            r->running += n;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Reap the completions of every submitted request, so the kernel is done
+// with the slot buffers before they are reused or the ring is unmapped.
+// Requests still queued are never submitted. Returns -1 if the wait
+// itself fails.
+static int ring_drain(struct Ring *r) {
+    for (;;) {
+        unsigned head = atomic_load_explicit(r->cq_head,
+        memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(r->cq_tail,
+        memory_order_acquire);
+        r->running -= tail - head;
+        atomic_store_explicit(r->cq_head, tail, memory_order_release);
+        if (r->running == 0) {
+            return 0;
+        }
+        if (syscall(__NR_io_uring_enter, r->fd, 0, 1,
+        IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// 1 if the ring takes the plain read and write opcodes. Kernels older
+// than 5.6 set up a ring but reject IORING_OP_READ/WRITE, and they do not
+// know IORING_REGISTER_PROBE either, so a failed probe means no.
+static int ring_probe(struct Ring *r) {
+    size_t size = sizeof(struct io_uring_probe)
+    + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, size);
+    if (!probe) {
+        return 0;
+    }
+    int ok = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+    probe, 256) == 0;
+    int ops[2] = {IORING_OP_READ, IORING_OP_WRITE};
+    for (int i = 0; ok && i < 2; ++i) {
+        ok = ops[i] <= probe->last_op
+        && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+int uring_supported(void) {
+    static _Atomic int supported = -1;
+    int known = atomic_load(&supported);
+    if (known < 0) {
+        struct Ring r;
+        known = ring_open(&r, 2) == 0;
+        if (known) {
+            known = ring_probe(&r);
+            ring_close(&r);
+        }
+        atomic_store(&supported, known);
+    }
+    return known;
+}
+
+struct UringSlot {
+    unsigned char *data;
+    int64_t frame;  // output frame held by the slot
+    size_t done;    // bytes of the current read or write completed
+    int writing;
+};
+
+int uring_process(struct Context *ctx, const char *input_file,
+                  const char *output_file, const struct Operation *ops,
+                  int count) {
+    int in_fd = open(input_file, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Error opening input file");
+        return -1;
+    }
+    struct Video video;
+    unsigned char head[HEADER_SIZE];
+    if (pread_full(in_fd, head, HEADER_SIZE, 0) != 0
+    || parse_header(head, &video) != 0) {
+        fprintf(stderr, "Error: Failed to read video header\n");
+        close(in_fd);
+        return -1;
+    }
+    metrics_count(ctx, HEADER_SIZE, 0, 0);
+    int reversed = check_stages(ops, count, &video);
+    if (reversed < 0) {
+        printf("Error: Invalid channel index.\n");
+        close(in_fd);
+        return -1;
+    }
+    size_t channel_size = video.height * video.width;
+    size_t frame_size = video.channels * channel_size;
+    int out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Error opening output file");
+        close(in_fd);
+        return -1;
+    }
+    if (pwrite_full(out_fd, head, HEADER_SIZE, 0) != 0) {
+        perror("Error writing output header");
+        close(in_fd);
+        close(out_fd);
+        return -1;
+    }
+    metrics_count(ctx, 0, HEADER_SIZE, 0);
+    // A video of empty frames is just its header; io_uring would report
+    // the zero-length transfers as end of file
+    if (frame_size == 0) {
+        close(in_fd);
+        if (close(out_fd) != 0) {
+            perror("Error writing output file");
+            return -1;
+        }
+        metrics_count(ctx, 0, 0, video.frames);
+        printf("Video processed through io_uring and saved to %s\n",
+        output_file);
+        return 0;
+    }
+
+    int depth = ctx->settings.uring_depth;
+    if (depth > video.frames) {
+        depth = video.frames > 0 ? (int)video.frames : 1;
+    }
+    unsigned char *buffers = pool_reserve(ctx, 1) == 0 ? pool_scratch(ctx, 0,
+    SCRATCH_RING, depth * frame_size) : NULL;
+    unsigned char *temp_channel = pool_scratch(ctx, 0, SCRATCH_CHANNEL,
+    channel_size);
+    struct UringSlot *slots = (struct UringSlot *)calloc(depth,
+    sizeof(struct UringSlot));
+    struct Ring ring;
+    if (!buffers || !temp_channel || !slots) {
+        fprintf(stderr, "Memory allocation failed for io_uring slots!\n");
+        free(slots);
+        close(in_fd);
+        close(out_fd);
+        return -1;
+    }
+    if (ring_open(&ring, depth) != 0) {
+        perror("Error setting up io_uring");
+        free(slots);
+        close(in_fd);
+        close(out_fd);
+        return -1;
+    }
+    // Fixed buffers save the page pinning on every request; without
+    // enough locked memory the plain opcodes do the same job
+    struct iovec registered = {buffers, depth * frame_size};
+    ring.fixed = syscall(__NR_io_uring_register, ring.fd,
+    IORING_REGISTER_BUFFERS, &registered, 1) == 0;
+
+    int64_t next = 0;      // next output frame to start
+    int64_t written = 0;
+    int in_flight = 0;
+    int failed = 0;
+    for (int i = 0; i < depth && next < video.frames; ++i, ++next) {
+        struct UringSlot *slot = &slots[i];
+        slot->data = buffers + i * frame_size;
+        slot->frame = next;
+        int64_t source = reversed ? video.frames - 1 - next : next;
+        ring_queue(&ring, 0, in_fd, slot->data, frame_size,
+        HEADER_SIZE + source * frame_size, i);
+        in_flight++;
+    }
+
+    while (in_flight > 0 && !failed) {
+        double start = metrics_begin(ctx);
+        if (ring_submit_wait(&ring) != 0) {
+            perror("Error waiting for io_uring");
+            failed = 1;
+            break;
+        }
+        metrics_end(ctx, STAGE_READ, start);
+        unsigned head_index = atomic_load_explicit(ring.cq_head,
+        memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(ring.cq_tail,
+        memory_order_acquire);
+        ring.running -= tail - head_index;
+        for (; head_index != tail; ++head_index) {
+            struct io_uring_cqe *cqe = &ring.cqes[head_index & *ring.cq_mask];
+            struct UringSlot *slot = &slots[cqe->user_data];
+            if (cqe->res <= 0) {
+                if (!failed) {
+                    fprintf(stderr, "Error %s frame %ld: %s\n",
+                    slot->writing ? "writing" : "reading", slot->frame,
+                    cqe->res < 0 ? strerror(-cqe->res) : "end of file");
+                }
+                failed = 1;
+                continue;
+            }
+            // Finish a short transfer before moving the slot on
+            slot->done += cqe->res;
+            int64_t source = reversed ? video.frames - 1 - slot->frame
+            : slot->frame;
+            off_t offset = HEADER_SIZE + (slot->writing ? slot->frame
+            : source) * frame_size;
+            if (slot->done < frame_size) {
+                ring_queue(&ring, slot->writing, slot->writing ? out_fd
+                : in_fd, slot->data + slot->done, frame_size - slot->done,
+                offset + slot->done, cqe->user_data);
+                continue;
+            }
+            slot->done = 0;
+            if (!slot->writing) {
+                metrics_count(ctx, frame_size, 0, 0);
+                double compute = metrics_begin(ctx);
+                apply_stages(slot->data, ops, count, channel_size,
+                temp_channel);
+                metrics_end(ctx, STAGE_COMPUTE, compute);
+                slot->writing = 1;
+                ring_queue(&ring, 1, out_fd, slot->data, frame_size,
+                HEADER_SIZE + slot->frame * frame_size, cqe->user_data);
+                continue;
+            }
+            metrics_count(ctx, 0, frame_size, 1);
+            written++;
+            in_flight--;
+            if (next < video.frames) {
+                slot->frame = next++;
+                slot->writing = 0;
+                source = reversed ? video.frames - 1 - slot->frame
+                : slot->frame;
+                ring_queue(&ring, 0, in_fd, slot->data, frame_size,
+                HEADER_SIZE + source * frame_size, cqe->user_data);
+                in_flight++;
+            }
+        }
+        atomic_store_explicit(ring.cq_head, head_index,
+        memory_order_release);
+    }
+
+    // After an error the other slots may still have requests in flight
+    if (ring_drain(&ring) != 0) {
+        perror("Error waiting for io_uring");
+        failed = 1;
+    }
+    ring_close(&ring);
+    free(slots);
+    close(in_fd);
+    if (close(out_fd) != 0 || written != video.frames) {
+        failed = 1;
+    }
+    if (failed) {
+        return -1;
+    }
+    printf("Video processed through io_uring and saved to %s\n",
+    output_file);
+    return 0;
+}
+
+#else
+
+int uring_supported(void) {
+    return 0;
+}
+
+int uring_process(struct Context *ctx, const char *input_file,
+                  const char *output_file, const struct Operation *ops,
+                  int count) {
+    (void)ctx;
+    (void)input_file;
+    (void)output_file;
+    (void)ops;
+    (void)count;
+    fprintf(stderr, "Error: Built without io_uring\n");
+    return -1;
+}
+
+#endif
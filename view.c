@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+// Views: reverse and swap_channel move frames and planes but never change
+// a pixel, so --view records them in a small text sidecar instead of
+// rewriting the video:
+//
+//   FMVIEW1
+//   source /abs/path/video.bin
+//   geometry <frames> <channels> <height> <width>
+//   frames <first> <last>
+//   reverse <0|1>
+//   perm <p0> [<p1> [<p2>]]
+//
+// The view is source frames [first, last), in reverse order if asked,
+// with output plane k taken from source plane perm[k]. Writing a view of a
+// view composes the transforms, so a chain of them stays O(1). Any other
+// run reads through the view: its transform becomes a permute and a
+// reverse stage in front of the job's own stages, and the source is
+// processed in one fused pass over just the range.
+
+#define VIEW_MAGIC "FMVIEW1"
+
+struct View {
+    char source[PATH_MAX];
+    struct Video geometry;  // of the source, to catch a changed source
+    int64_t first, last;
+    int reversed;
+    unsigned char perm[MAX_CH];
+};
+
+int is_view(const char *path) {
+    if (is_stdio_path(path)) {
+        return 0;
+    }
+    FILE *file = fopen(path, "r");
+    char magic[sizeof(VIEW_MAGIC)] = {0};
+    int found = file && fread(magic, 1, sizeof(magic) - 1, file)
+    == sizeof(magic) - 1 && strcmp(magic, VIEW_MAGIC) == 0;
+    if (file) {
+        fclose(file);
+    }
+    return found;
+}
+
+// Header of a raw video or of a compressed container
+static int source_header(const char *path, struct Video *video) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening view source");
+        return -1;
+    }
+    unsigned char head[HEADER_SIZE];
+    off_t offset = is_container(path) ? 4 : 0;
+    int result = pread_full(fd, head, HEADER_SIZE, offset) == 0
+    && parse_header(head, video) == 0 ? 0 : -1;
+    close(fd);
+    if (result != 0) {
+        fprintf(stderr, "Error: Failed to read video header of %s\n", path);
+    }
+    return result;
+}
+
+static int load_view(const char *path, struct View *view) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Error opening view");
+        return -1;
+    }
+    char line[PATH_MAX + 16];
+    int ok = fgets(line, sizeof(line), file) && strncmp(line, VIEW_MAGIC,
+    strlen(VIEW_MAGIC)) == 0 && fgets(line, sizeof(line), file)
+    && strncmp(line, "source ", 7) == 0;
+    if (ok) {
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(view->source, sizeof(view->source), "%s", line + 7);
+    }
+    long frames, first, last;
+    int channels, height, width, reversed;
+    int perm[MAX_CH] = {0};
+    ok = ok && fscanf(file, " geometry %ld %d %d %d", &frames, &channels,
+    &height, &width) == 4 && fscanf(file, " frames %ld %ld", &first, &last)
+    == 2 && fscanf(file, " reverse %d", &reversed) == 1
+    && fscanf(file, " perm") == 0 && channels >= 1 && channels <= MAX_CH;
+    for (int c = 0; ok && c < channels; ++c) {
+        ok = fscanf(file, "%d", &perm[c]) == 1 && perm[c] >= 0
+        && perm[c] < channels;
+    }
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "Error: %s is not a valid view\n", path);
+        return -1;
+    }
+
+    struct Video video;
+    if (source_header(view->source, &video) != 0) {
+        return -1;
+    }
+    if (video.frames != frames || video.channels != channels
+    || video.height != height || video.width != width || first < 0
+    || first > last || last > frames) {
+        fprintf(stderr, "Error: %s no longer matches view %s\n",
+        view->source, path);
+        return -1;
+    }
+    view->geometry = video;
+    view->first = first;
+    view->last = last;
+    view->reversed = reversed != 0;
+    for (int c = 0; c < MAX_CH; ++c) {
+        view->perm[c] = (unsigned char)perm[c];
+    }
+    return 0;
+}
+
+static int save_view(const char *path, const struct View *view) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Error opening output file");
+        return -1;
+    }
+    fprintf(file, "%s\nsource %s\ngeometry %ld %d %d %d\nframes %ld %ld\n"
+    "reverse %d\nperm", VIEW_MAGIC, view->source, view->geometry.frames,
+    view->geometry.channels, view->geometry.height, view->geometry.width,
+    view->first, view->last, view->reversed);
+    for (int c = 0; c < view->geometry.channels; ++c) {
+        fprintf(file, " %d", view->perm[c]);
+    }
+    fprintf(file, "\n");
+    if (fclose(file) != 0) {
+        perror("Error writing view");
+        return -1;
+    }
+    return 0;
+}
+
+// The whole of a video file as a view
+static int identity_view(const char *path, struct View *view) {
+    if (!realpath(path, view->source)) {
+        perror("Error opening input file");
+        return -1;
+    }
+    if (source_header(view->source, &view->geometry) != 0) {
+        return -1;
+    }
+    view->first = 0;
+    view->last = view->geometry.frames;
+    view->reversed = 0;
+    for (int c = 0; c < MAX_CH; ++c) {
+        view->perm[c] = (unsigned char)c;
+    }
+    return 0;
+}
+
+// Narrow the view to its frames [first, last), last = 0 for the end
+static int select_frames(struct View *view, int64_t first, int64_t last) {
+    int64_t frames = view->last - view->first;
+    if (last == 0) {
+        last = frames;
+    }
+    if (first > last || last > frames) {
+        printf("Error: Frames %ld:%ld are outside the video (%ld frames)\n",
+        first, last, frames);
+        return -1;
+    }
+    // Frame j of a reversed view is source frame last - 1 - j
+    if (view->reversed) {
+        view->first = view->last - last;
+        view->last = view->last - first;
+    } else {
+        view->last = view->first + last;
+        view->first += first;
+    }
+    return 0;
+}
+
+static int compose_ops(struct View *view, const struct Operation *ops,
+                       int count) {
+    int channels = view->geometry.channels;
+    for (int i = 0; i < count; ++i) {
+        unsigned char perm[MAX_CH], composed[MAX_CH];
+        if (ops[i].type == OP_REVERSE) {
+            view->reversed = !view->reversed;
+            continue;
+        }
+        if ((ops[i].type != OP_SWAP && ops[i].type != OP_PERMUTE)
+        || stage_permutation(&ops[i], channels, perm) != 0) {
+            printf("Error: --view takes only reverse and swap_channel on"
+            " valid channels.\n");
+            return -1;
+        }
+        for (int c = 0; c < channels; ++c) {
+            composed[c] = view->perm[perm[c]];
+        }
+        memcpy(view->perm, composed, channels);
+    }
+    return 0;
+}
+
+int view_process(struct Context *ctx, const char *input_file,
+                 const char *output_file, const struct Operation *ops,
+                 int count, int memory_free) {
+    if (is_stdio_path(input_file) || is_stdio_path(output_file)) {
+        printf("Error: Views need file paths, not -\n");
+        return -1;
+    }
+    struct View view;
+    if ((is_view(input_file) ? load_view(input_file, &view)
+    : identity_view(input_file, &view)) != 0
+    || select_frames(&view, ctx->settings.first_frame,
+    ctx->settings.last_frame) != 0) {
+        return -1;
+    }
+    if (view.first == view.last && !ctx->settings.view) {
+        printf("Error: The view has no frames.\n");
+        return -1;
+    }
+    if (ctx->settings.view) {
+        if (compose_ops(&view, ops, count) != 0
+        || save_view(output_file, &view) != 0) {
+            return -1;
+        }
+        printf("View of %s saved to %s\n", view.source, output_file);
+        return 0;
+    }
+
+    // Read through: the view's own stages run first, then the job's
+    struct Operation *stages = (struct Operation *)calloc(count + 2,
+    sizeof(struct Operation));
+    if (!stages) {
+        fprintf(stderr, "Memory allocation failed for view stages!\n");
+        return -1;
+    }
+    int n = 0;
+    int channels = view.geometry.channels;
+    int identity = 1;
+    for (int c = 0; c < channels; ++c) {
+        identity &= view.perm[c] == c;
+    }
+    // A view with no stages of its own still needs one to be copied
+    if (!identity || (!view.reversed && count == 0)) {
+        stages[n].type = OP_PERMUTE;
+        memcpy(stages[n].perm, view.perm, channels);
+        stages[n].perm_len = (unsigned char)channels;
+        n++;
+    }
+    if (view.reversed) {
+        stages[n++].type = OP_REVERSE;
+    }
+    if (count > 0) {
+        memcpy(stages + n, ops, count * sizeof(struct Operation));
+        n += count;
+    }
+
+    struct Settings saved = ctx->settings;
+    int whole = view.first == 0 && view.last == view.geometry.frames;
+    ctx->settings.first_frame = whole ? 0 : view.first;
+    ctx->settings.last_frame = whole ? 0 : view.last;
+    int result = process_file(ctx, view.source, output_file, stages, n,
+    memory_free);
+    ctx->settings = saved;
+    free(stages);
+    return result;
+}
+
+int materialize_view(struct Context *ctx, const char *view_file,
+                     const char *output_file, int memory_free) {
+    if (!is_view(view_file)) {
+        fprintf(stderr, "Error: %s is not a view\n", view_file);
+        return -1;
+    }
+    struct Settings saved = ctx->settings;
+    ctx->settings.view = 0;
+    int result = view_process(ctx, view_file, output_file, NULL, 0,
+    memory_free);
+    ctx->settings = saved;
+    return result;
+}